@@ -0,0 +1,148 @@
+// Times every kernel compiled by cju against its C reference and fails when cju is
+// more than the margin slower. Usage: bench [margin percent] [iterations] [reference compiler]
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef float (*Kernel2)(float, float);
+typedef float (*Kernel4)(float, float, float, float);
+typedef float (*Kernel8)(float, float, float, float, float, float, float, float);
+typedef void (*ArrayKernel)(float *, const float *, const float *, int);
+
+// name, argument count, percent the kernel may be slower on top of the margin. LLVM's SLP
+// vectorizer packs the arguments of sum8 into vectors for a predicted small gain, which costs about
+// 25% against a compiler that keeps it scalar, like gcc.
+#define BENCH_KERNELS(X) \
+    X(add2, 2, 0)        \
+    X(add4, 4, 0)        \
+    X(chain4, 4, 0)      \
+    X(sum8, 8, 30)
+
+// Kernels over arrays, name(out, a, b, n)
+#define BENCH_ARRAY_KERNELS(X) \
+    X(addArrays)               \
+    X(scaleAdd)                \
+    X(magnitudes)              \
+    X(dotArrays)               \
+    X(sumDiffs)
+
+// Elements per call of the array kernels, small enough to stay in the L1 cache
+#define ARRAY_LENGTH 1024
+
+#define DECLARE_KERNEL(name, argCount, slack) \
+    extern float name();                      \
+    extern float ref_##name();
+BENCH_KERNELS(DECLARE_KERNEL)
+
+#define DECLARE_ARRAY_KERNEL(name)                                          \
+    extern void name(float *out, const float *a, const float *b, int n); \
+    extern void ref_##name(float *out, const float *a, const float *b, int n);
+BENCH_ARRAY_KERNELS(DECLARE_ARRAY_KERNEL)
+
+struct Kernel {
+    const char *name;
+    int argCount; // 0 for array kernels
+    double slack; // Percent on top of the margin
+    void (*cju)(void);
+    void (*reference)(void);
+};
+
+#define KERNEL_ENTRY(name, argCount, slack) { #name, argCount, slack, (void (*)(void))name, (void (*)(void))ref_##name },
+#define ARRAY_KERNEL_ENTRY(name) { #name, 0, 0, (void (*)(void))name, (void (*)(void))ref_##name },
+static const struct Kernel kernels[] = { BENCH_KERNELS(KERNEL_ENTRY) BENCH_ARRAY_KERNELS(ARRAY_KERNEL_ENTRY) };
+
+static float arrayA[ARRAY_LENGTH];
+static float arrayB[ARRAY_LENGTH];
+static float arrayOut[ARRAY_LENGTH];
+
+static volatile float sink;
+
+static double nowNs(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+// Calls go through a volatile pointer, so neither side can be inlined into the loop
+static double timeKernel(void (*function)(void), int argCount, long iterations)
+{
+    void (*volatile kernel)(void) = function;
+    float acc = 0.0f;
+    float x = 1.0f;
+
+    // Array kernels do ARRAY_LENGTH elements per call
+    if (argCount == 0) {
+        iterations = iterations / ARRAY_LENGTH + 1;
+    }
+
+    double start = nowNs();
+    for (long i = 0; i < iterations; ++i) {
+        switch (argCount) {
+        case 0:
+            ((ArrayKernel)kernel)(arrayOut, arrayA, arrayB, ARRAY_LENGTH);
+            acc += arrayOut[i % ARRAY_LENGTH];
+            break;
+        case 2:
+            acc += ((Kernel2)kernel)(x, acc);
+            break;
+        case 4:
+            acc += ((Kernel4)kernel)(x, acc, x, acc);
+            break;
+        case 8:
+            acc += ((Kernel8)kernel)(x, acc, x, acc, x, acc, x, acc);
+            break;
+        }
+        acc *= 0.5f;
+    }
+    double elapsed = nowNs() - start;
+
+    sink = acc;
+    return elapsed / iterations;
+}
+
+static double bestOf(void (*function)(void), int argCount, long iterations)
+{
+    double best = timeKernel(function, argCount, iterations);
+    for (int run = 1; run < 5; ++run) {
+        double ns = timeKernel(function, argCount, iterations);
+        best = ns < best ? ns : best;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    double margin = argc > 1 ? atof(argv[1]) : 10.0;
+    long iterations = argc > 2 ? atol(argv[2]) : 20000000;
+    const char *compiler = argc > 3 ? argv[3] : "reference";
+
+    for (int i = 0; i < ARRAY_LENGTH; ++i) {
+        arrayA[i] = (float)i;
+        arrayB[i] = 1.0f / (float)(i + 1);
+    }
+
+    char referenceColumn[64];
+    snprintf(referenceColumn, sizeof(referenceColumn), "%s ns/call", compiler);
+    printf("%-10s %14s %14s %8s %16s\n", "kernel", "cju ns/call", referenceColumn, "ratio", "cju Mcalls/s");
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        const struct Kernel *kernel = &kernels[i];
+        double cjuNs = bestOf(kernel->cju, kernel->argCount, iterations);
+        double referenceNs = bestOf(kernel->reference, kernel->argCount, iterations);
+        double ratio = cjuNs / referenceNs;
+        int failed = ratio > 1.0 + (margin + kernel->slack) / 100.0;
+        failures += failed;
+
+        printf("%-10s %14.3f %14.3f %8.3f %16.1f%s\n", kernel->name, cjuNs, referenceNs, ratio, 1000.0 / cjuNs,
+               failed ? "  FAIL" : "");
+    }
+
+    if (failures) {
+        printf("%d kernel(s) more than %.1f%% and their slack slower than %s\n", failures, margin, compiler);
+        return EXIT_FAILURE;
+    }
+    printf("All kernels within %.1f%% and their slack of %s\n", margin, compiler);
+    return EXIT_SUCCESS;
+}
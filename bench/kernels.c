@@ -0,0 +1,70 @@
+// Kernels compiled by cju for the benchmark, every kernel has a C twin in reference.c
+float add2(float a, float b)
+{
+    float result = a + b;
+    return result;
+}
+
+float add4(float a, float b, float c, float d)
+{
+    float ab = a + b;
+    float cd = c + d;
+    float result = ab + cd;
+    return result;
+}
+
+float chain4(float a, float b, float c, float d)
+{
+    float ab = a + b;
+    float abc = ab + c;
+    float result = abc + d;
+    return result;
+}
+
+float sum8(float a, float b, float c, float d, float e, float f, float g, float h)
+{
+    float ab = a + b;
+    float cd = c + d;
+    float ef = e + f;
+    float gh = g + h;
+    float abcd = ab + cd;
+    float efgh = ef + gh;
+    float result = abcd + efgh;
+    return result;
+}
+
+void addArrays(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+void scaleAdd(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] * 2.0f + b[i];
+    }
+}
+
+void magnitudes(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = sqrt(a[i] * a[i] + b[i] * b[i]);
+    }
+}
+
+void dotArrays(float *restrict out, const float *a, const float *b, int n)
+{
+    out[0] = dot(a, b, n);
+}
+
+void sumDiffs(float *restrict out, const float *a, const float *b, int n)
+{
+    float sum = 0.0f;
+    #pragma vectorize(8) interleave(4)
+    for (int i = 0; i < n; i++) {
+        sum += a[i] - b[i];
+    }
+    out[0] = sum;
+}
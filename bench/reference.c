@@ -0,0 +1,64 @@
+// C references of the kernels in kernels.c, compiled with clang -O2 for the same cpu
+#include <math.h>
+
+float ref_add2(float a, float b)
+{
+    return a + b;
+}
+
+float ref_add4(float a, float b, float c, float d)
+{
+    return (a + b) + (c + d);
+}
+
+float ref_chain4(float a, float b, float c, float d)
+{
+    return ((a + b) + c) + d;
+}
+
+float ref_sum8(float a, float b, float c, float d, float e, float f, float g, float h)
+{
+    return ((a + b) + (c + d)) + ((e + f) + (g + h));
+}
+
+void ref_addArrays(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+void ref_scaleAdd(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] * 2.0f + b[i];
+    }
+}
+
+void ref_magnitudes(float *restrict out, const float *a, const float *b, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = sqrtf(a[i] * a[i] + b[i] * b[i]);
+    }
+}
+
+void ref_dotArrays(float *restrict out, const float *a, const float *b, int n)
+{
+    float sum = 0.0f;
+    // Lets clang reorder the sum across lanes and accumulators, as the dot builtin does
+#pragma clang loop vectorize(enable) interleave_count(4)
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    out[0] = sum;
+}
+
+void ref_sumDiffs(float *restrict out, const float *a, const float *b, int n)
+{
+    float sum = 0.0f;
+#pragma clang loop vectorize_width(8) interleave_count(4)
+    for (int i = 0; i < n; i++) {
+        sum += a[i] - b[i];
+    }
+    out[0] = sum;
+}
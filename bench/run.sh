@@ -0,0 +1,29 @@
+#!/bin/bash
+# Compiles the kernels with cju and their C references with $CC for the same cpu,
+# links both into the timing driver and runs it. Expects ./cju to be built already.
+#   CPU        Target cpu for both compilers, defaults to x86-64
+#   CC         Compiler of the references, defaults to clang
+#   MARGIN     Percent cju may be slower than the references before the benchmark fails, defaults to 10
+#   ITERATIONS Calls per timed run, defaults to 20000000
+set -e
+
+bench_dir="$(cd "$(dirname "$0")" && pwd)"
+cju="${bench_dir}/../cju"
+cc="${CC:-clang}"
+cpu="${CPU:-x86-64}"
+margin="${MARGIN:-10}"
+iterations="${ITERATIONS:-20000000}"
+
+out_dir="$(mktemp -d)"
+trap 'rm -rf "${out_dir}"' EXIT
+
+echo ----Compiling kernels with cju -O2 -mcpu=${cpu}
+(cd "${out_dir}" && "${cju}" -O2 -mcpu=${cpu} "${bench_dir}/kernels.c" > /dev/null)
+
+echo ----Compiling references with ${cc} -O2 -march=${cpu}
+${cc} -O2 -march=${cpu} -c "${bench_dir}/reference.c" -o "${out_dir}/reference.o"
+${cc} -O2 -c "${bench_dir}/driver.c" -o "${out_dir}/driver.o"
+${cc} "${out_dir}/driver.o" "${out_dir}/reference.o" "${out_dir}/output.o" -lm -o "${out_dir}/bench"
+
+echo ----Running benchmark
+"${out_dir}/bench" ${margin} ${iterations} "${cc}"
@@ -4,12 +4,15 @@ export cwd=`pwd`
 cc=clang++
 
 # Getting LLVM flags
-llvm_flags="`llvm-config --cxxflags --ldflags --system-libs --libs core`"
+llvm_flags="`llvm-config --cxxflags --ldflags --system-libs --libs core bitreader bitwriter object ipo transformutils orcjit native all-targets`"
 
 # Specifying the compile command
 src_file="src/main.cpp"
 
-compiler_flags_generic="-std=c++17 -Wall -Wextra -pedantic -Werror"
+# Part of the cache keys, see src/cache.hpp
+build_id="`git describe --always --dirty 2>/dev/null || echo unknown`"
+
+compiler_flags_generic="-std=c++17 -Wall -Wextra -pedantic -Werror -DCJU_BUILD_ID=${build_id}"
 compiler_flags_release="-O3"
 compiler_flags_debug="-g -O0"
 
@@ -21,12 +24,27 @@ else
   compilation_type="debug"
   compiler_flags="${compiler_flags_debug} ${compiler_flags_generic}"
 fi
-export compile_command="${cc} ${compiler_flags} ${src_file} ${llvm_flags} -o cju"
+export compile_command="${cc} ${compiler_flags} ${src_file} runtime.o ${llvm_flags} -lpthread -o cju"
 
 echo Starting ${compilation_type} compilation
+# Runtime library that objects with parallel for link, see src/runtime.h. cju links it as well,
+# so that parallel for also works in the jit.
+runtime_compile_command="clang -std=c11 -O2 -fPIC -Wall -Wextra -pedantic -Werror -c src/runtime.c -o runtime.o"
+${runtime_compile_command}
+ar rcs libcjurt.a runtime.o
+
 # Compiling the actual program
 ${compile_command}
 
+# The client of cju --server doesn't link LLVM, so that it starts fast
+client_compile_command="${cc} ${compiler_flags} src/client.cpp -o cju-client"
+${client_compile_command}
+
+# Embeddable library, see src/libcju.h
+library_compile_command="${cc} ${compiler_flags} `llvm-config --cxxflags` -c src/libcju.cpp -o libcju.o"
+${library_compile_command}
+ar rcs libcju.a libcju.o runtime.o
+
 echo Exporting compile_commands.json
 # Exporting a compile_commands.json for editors, so they can have better intellisense features etc.
 
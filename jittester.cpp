@@ -0,0 +1,35 @@
+// Testing file for the jit API, compiles test.c and a second source into one jit and calls them
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "src/cju.hpp"
+
+int main()
+{
+    std::ifstream file("test.c");
+    std::stringstream source;
+    source << file.rdbuf();
+
+    auto jit = cju::createJit();
+    if (!jit) {
+        return 1;
+    }
+    cju::Options options;
+    auto *add = reinterpret_cast<float (*)(float, float)>(cju::jitCompile(*jit, source.str(), "add", options));
+    if (!add) {
+        return 1;
+    }
+    printf("jittester.cpp: result from add(3.0f, 4.0f) = %f\n", add(3.0f, 4.0f));
+
+    // Functions of earlier sources are called through a declaration
+    const char *doubled = "extern float add(float a, float b);\n"
+                          "float addDoubled(float a, float b) { return add(a, b) * 2.0f; }\n";
+    auto *addDoubled = reinterpret_cast<float (*)(float, float)>(cju::jitCompile(*jit, doubled, "addDoubled", options));
+    if (!addDoubled) {
+        return 1;
+    }
+    printf("jittester.cpp: result from addDoubled(3.0f, 4.0f) = %f\n", addDoubled(3.0f, 4.0f));
+
+    return 0;
+}
@@ -1,12 +1,27 @@
+#pragma once
+
 #include "common.h"
+#include "options.hpp"
+#include "output.hpp"
+#include "timing.hpp"
 
 namespace cju
 {
 
-static llvm::LLVMContext llvmContext;
-static llvm::IRBuilder<> llvmBuilder(llvmContext);
-static llvm::Module *llvmModule;
-static std::unordered_map<std::string, llvm::Value *> llvmNamedValues; // TODO: Support scopes instead of having this be global
+// The code generation state is per thread, so that separate threads can compile at the same time
+static thread_local llvm::LLVMContext llvmContext;
+static thread_local llvm::IRBuilder<> llvmBuilder(llvmContext);
+static thread_local llvm::Module *llvmModule;
+// Locals of the function being generated, every block restores it when it ends so that names are scoped to it
+static thread_local std::unordered_map<std::string, llvm::AllocaInst *> llvmNamedValues;
+// Contraction of the function being generated, the rest of its float semantics are flags on llvmBuilder
+static thread_local FpContract functionFpContract = FpContract::off;
+
+struct PrototypeAST;
+// Every prototype seen so far, so that functions can be declared again in modules other than the defining one
+static thread_local std::unordered_map<std::string, PrototypeAST *> functionProtos;
+
+inline llvm::Function *getFunction(const std::string &name);
 
 struct ExprAST {
     ExprAST() = default;
@@ -19,36 +34,469 @@ struct ExprAST {
     virtual nlohmann::json toJson() = 0;
     virtual llvm::Value *codeGen() = 0;
 
+    // Address the expression can be assigned through, only locals have one
+    virtual llvm::Value *codeGenAddress()
+    {
+        logError("Expression cannot be assigned to");
+        return nullptr;
+    }
+
+    // Name of the node kind, e.g. for statistics
+    virtual const char *kindName() const = 0;
+
+    // Calls visitor for every direct child node
+    virtual void visitChildren(const std::function<void(ExprAST *)> &)
+    {
+    }
+
     virtual void logError(const std::string &msg)
     {
-        std::cerr << "[ERROR] " << typeid(*this).name() << ": " << msg << std::endl;
+        errs() << "[ERROR] " << typeid(*this).name() << ": " << msg << std::endl;
     }
 };
 
+inline bool isScalarTypeName(const std::string &name)
+{
+    return name == "int" || name == "long" || name == "float" || name == "double";
+}
+
+// Vector types are a scalar type followed by the number of lanes, e.g. float4 or int8
+inline bool splitVectorTypeName(const std::string &name, std::string &elementName, unsigned &lanes)
+{
+    for (unsigned count : { 2, 4, 8, 16 }) {
+        std::string suffix = std::to_string(count);
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0 &&
+            isScalarTypeName(name.substr(0, name.size() - suffix.size()))) {
+            elementName = name.substr(0, name.size() - suffix.size());
+            lanes = count;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool isVectorTypeName(const std::string &name)
+{
+    std::string elementName;
+    unsigned lanes;
+    return splitVectorTypeName(name, elementName, lanes);
+}
+
+// Types of the language, as they are spelled in the source
+inline bool isTypeName(const std::string &name)
+{
+    return isScalarTypeName(name) || isVectorTypeName(name) || name == "void";
+}
+
+inline llvm::Type *getType(const std::string &type)
+{
+    // Pointers are spelled with a trailing *, e.g. float*
+    if (!type.empty() && type.back() == '*') {
+        llvm::Type *elementType = getType(type.substr(0, type.size() - 1));
+        if (!elementType || elementType->isVoidTy()) {
+            return nullptr;
+        }
+        return llvm::PointerType::getUnqual(elementType);
+    }
+    // Vectors are LLVM's fixed vectors, which are passed like the vector types of C compilers, e.g. float4 like __m128
+    std::string elementName;
+    unsigned lanes;
+    if (splitVectorTypeName(type, elementName, lanes)) {
+        return llvm::VectorType::get(getType(elementName), lanes, false);
+    }
+    if (type == "void") {
+        return llvm::Type::getVoidTy(llvmContext);
+    }
+    if (type == "int") {
+        return llvm::Type::getInt32Ty(llvmContext);
+    }
+    if (type == "long") {
+        return llvm::Type::getInt64Ty(llvmContext);
+    }
+    if (type == "float") {
+        return llvm::Type::getFloatTy(llvmContext);
+    }
+    if (type == "double") {
+        return llvm::Type::getDoubleTy(llvmContext);
+    }
+    return nullptr;
+}
+
+// Type of the values a pointer points to
+inline llvm::Type *getElementType(llvm::Value *pointer)
+{
+    return pointer->getType()->getPointerElementType();
+}
+
+inline unsigned laneCount(llvm::Type *vectorType)
+{
+    return llvm::cast<llvm::VectorType>(vectorType)->getNumElements();
+}
+
+// Converts between the types the way C does, integers are signed. Scalars are converted to the
+// element type and splat into every lane of a vector, vectors convert lane by lane.
+inline llvm::Value *convertValue(llvm::Value *value, llvm::Type *type, llvm::IRBuilder<> &builder = llvmBuilder)
+{
+    llvm::Type *from = value->getType();
+    if (from == type) {
+        return value;
+    }
+    if (type->isVectorTy() && !from->isVectorTy()) {
+        llvm::Value *element = convertValue(value, type->getScalarType(), builder);
+        return element ? builder.CreateVectorSplat(laneCount(type), element, "splattmp") : nullptr;
+    }
+    if (type->isVectorTy() != from->isVectorTy() || (type->isVectorTy() && laneCount(type) != laneCount(from))) {
+        return nullptr;
+    }
+
+    llvm::Type *fromElement = from->getScalarType();
+    llvm::Type *toElement = type->getScalarType();
+    // Results of comparisons are 0 or 1 like in C
+    if (fromElement->isIntegerTy(1) && toElement->isIntegerTy()) {
+        return builder.CreateZExt(value, type, "convtmp");
+    }
+    if (fromElement->isIntegerTy(1) && toElement->isFloatingPointTy()) {
+        return builder.CreateUIToFP(value, type, "convtmp");
+    }
+    if (fromElement->isIntegerTy() && toElement->isIntegerTy()) {
+        return builder.CreateSExtOrTrunc(value, type, "convtmp");
+    }
+    if (fromElement->isIntegerTy() && toElement->isFloatingPointTy()) {
+        return builder.CreateSIToFP(value, type, "convtmp");
+    }
+    if (fromElement->isFloatingPointTy() && toElement->isIntegerTy()) {
+        return builder.CreateFPToSI(value, type, "convtmp");
+    }
+    if (fromElement->isFloatingPointTy() && toElement->isFloatingPointTy()) {
+        return builder.CreateFPCast(value, type, "convtmp");
+    }
+    return nullptr;
+}
+
+// Type both operands of a binary operator are converted to: the wider floating point type
+// if either of them is one, the wider integer type otherwise, but at least int
+inline llvm::Type *commonType(llvm::Type *a, llvm::Type *b)
+{
+    // The same rules apply lane by lane to vectors, a scalar operand is splat to the vector
+    if (a->isVectorTy() || b->isVectorTy()) {
+        if (a->isVectorTy() && b->isVectorTy() && laneCount(a) != laneCount(b)) {
+            return nullptr;
+        }
+        llvm::Type *element = commonType(a->getScalarType(), b->getScalarType());
+        return llvm::VectorType::get(element, laneCount(a->isVectorTy() ? a : b), false);
+    }
+
+    if (a->isFloatingPointTy() || b->isFloatingPointTy()) {
+        if (!b->isFloatingPointTy()) {
+            return a;
+        }
+        if (!a->isFloatingPointTy()) {
+            return b;
+        }
+    }
+    llvm::Type *type = a->getPrimitiveSizeInBits() >= b->getPrimitiveSizeInBits() ? a : b;
+    return type->isIntegerTy(1) ? llvm::Type::getInt32Ty(llvmContext) : type;
+}
+
+// Truth value of a condition like in C, anything but zero is true
+inline llvm::Value *createCondition(llvm::Value *value)
+{
+    llvm::Type *type = value->getType();
+    if (type->isIntegerTy(1)) {
+        return value;
+    }
+    if (type->isIntegerTy()) {
+        return llvmBuilder.CreateICmpNE(value, llvm::ConstantInt::get(type, 0), "cond");
+    }
+    if (type->isFloatingPointTy()) {
+        return llvmBuilder.CreateFCmpUNE(value, llvm::ConstantFP::get(type, 0.0), "cond");
+    }
+    if (type->isPointerTy()) {
+        return llvmBuilder.CreateIsNotNull(value, "cond");
+    }
+    return nullptr;
+}
+
+// Generates the expression as the condition of an if, loop or logical operator
+inline llvm::Value *codeGenCondition(ExprAST *expr)
+{
+    llvm::Value *value = expr->codeGen();
+    if (!value) {
+        return nullptr;
+    }
+    llvm::Value *condition = createCondition(value);
+    if (!condition) {
+        expr->logError("Value cannot be used as a condition");
+    }
+    return condition;
+}
+
+// Branches on the condition, or straight to the taken block when it is a constant. That way
+// nothing after e.g. while (1) is reachable when the loop can only be left through a return.
+inline void createCondBr(llvm::Value *condition, llvm::BasicBlock *trueBlock, llvm::BasicBlock *falseBlock)
+{
+    if (auto *constant = llvm::dyn_cast<llvm::ConstantInt>(condition)) {
+        llvmBuilder.CreateBr(constant->isZero() ? falseBlock : trueBlock);
+    } else {
+        llvmBuilder.CreateCondBr(condition, trueBlock, falseBlock);
+    }
+}
+
+// Whether the block being generated already ended, e.g. in a return. Statements after that are unreachable.
+inline bool isInsertBlockTerminated()
+{
+    return llvmBuilder.GetInsertBlock()->getTerminator() != nullptr;
+}
+
+// Locals live in allocas at the start of the entry block, where mem2reg promotes them to registers
+inline llvm::AllocaInst *createEntryBlockAlloca(llvm::Type *type, const std::string &name)
+{
+    llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+    llvm::IRBuilder<> builder(&function->getEntryBlock(), function->getEntryBlock().begin());
+    return builder.CreateAlloca(type, nullptr, name);
+}
+
+// mem2reg right away instead of in the optimizer, so that even unoptimized code keeps its locals in registers
+inline void promoteLocals(llvm::Function &function)
+{
+    std::vector<llvm::AllocaInst *> allocas;
+    for (auto &instruction : function.getEntryBlock()) {
+        auto *alloca = llvm::dyn_cast<llvm::AllocaInst>(&instruction);
+        if (alloca && llvm::isAllocaPromotable(alloca)) {
+            allocas.push_back(alloca);
+        }
+    }
+    if (!allocas.empty()) {
+        llvm::DominatorTree dominatorTree(function);
+        llvm::PromoteMemToReg(allocas, dominatorTree);
+    }
+}
+
+// Statements have no value, they return this on success since nullptr means failure
+inline llvm::Value *statementSuccess()
+{
+    return llvm::ConstantInt::getTrue(llvmContext);
+}
+
 struct NumberAST : public ExprAST {
-    NumberAST(float value)
-        : value(value)
+    // Integer literals are int, or long if they don't fit into one. Floating point literals
+    // are double, or float with an f suffix.
+    NumberAST(int64_t intValue)
+        : type(intValue >= INT32_MIN && intValue <= INT32_MAX ? "int" : "long")
+        , intValue(intValue)
+        , floatValue(static_cast<double>(intValue))
+    {
+    }
+
+    NumberAST(double floatValue, bool singlePrecision)
+        : type(singlePrecision ? "float" : "double")
+        , intValue(static_cast<int64_t>(floatValue))
+        , floatValue(floatValue)
+    {
+    }
+
+    virtual const char *kindName() const override
     {
+        return "Number";
     }
 
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
 
-        json["value"] = value;
+        if (isInteger()) {
+            json["value"] = intValue;
+        } else {
+            json["value"] = floatValue;
+        }
+        json["type"] = type;
 
         return json;
     }
 
+    bool isInteger() const
+    {
+        return type == "int" || type == "long";
+    }
+
+    // Whether the literal can take the type of the expression it is used in without changing its
+    // value, e.g. the 2 in x * 2 for a float x. Floating point literals are rounded to float then.
+    bool fitsInto(llvm::Type *contextType) const
+    {
+        // Splat into every lane of a vector
+        contextType = contextType->getScalarType();
+        if (contextType->isFloatingPointTy()) {
+            return true;
+        }
+        if (!contextType->isIntegerTy() || !isInteger()) {
+            return false;
+        }
+        unsigned bits = contextType->getIntegerBitWidth();
+        return bits >= 64 || (intValue >= -(int64_t(1) << (bits - 1)) && intValue < (int64_t(1) << (bits - 1)));
+    }
+
+    llvm::Value *codeGenAs(llvm::Type *valueType)
+    {
+        if (valueType->isIntOrIntVectorTy()) {
+            return llvm::ConstantInt::get(valueType, static_cast<uint64_t>(intValue), true);
+        }
+        return llvm::ConstantFP::get(valueType, floatValue);
+    }
+
     virtual llvm::Value *codeGen() override
     {
-        llvm::Value *result = llvm::ConstantFP::get(llvmContext, llvm::APFloat(value));
-        return result;
+        return codeGenAs(getType(type));
     }
 
-    float value;
+    std::string type;
+    int64_t intValue;
+    double floatValue;
 };
 
+// Generates the expression converted to the type. Literals that fit are generated in the type directly.
+inline llvm::Value *codeGenAs(ExprAST *expr, llvm::Type *type)
+{
+    auto *number = dynamic_cast<NumberAST *>(expr);
+    if (number && number->fitsInto(type)) {
+        return number->codeGenAs(type);
+    }
+
+    llvm::Value *value = expr->codeGen();
+    if (!value) {
+        return nullptr;
+    }
+    llvm::Value *result = convertValue(value, type);
+    if (!result) {
+        expr->logError("Cannot convert the value to the expected type");
+    }
+    return result;
+}
+
+// Generates an operand of a binary operator. A literal takes the type of the other operand
+// if it fits, so that e.g. x * 2 stays in float.
+inline llvm::Value *codeGenOperand(ExprAST *expr, llvm::Type *otherType)
+{
+    auto *number = dynamic_cast<NumberAST *>(expr);
+    if (number && otherType && number->fitsInto(otherType)) {
+        return number->codeGenAs(otherType);
+    }
+    return expr->codeGen();
+}
+
+inline bool isComparisonOp(const std::string &op)
+{
+    return op == "==" || op == "!=" || op == "<" || op == "<=" || op == ">" || op == ">=";
+}
+
+// Converts both operands to their common type and applies an arithmetic or comparison operator,
+// returns nullptr for any other operator
+inline llvm::Value *createBinaryOp(const std::string &op, llvm::Value *l, llvm::Value *r)
+{
+    // Pointers only support indexing
+    if (l->getType()->isPointerTy() || r->getType()->isPointerTy()) {
+        return nullptr;
+    }
+
+    llvm::Type *type = commonType(l->getType(), r->getType());
+    if (!type) {
+        return nullptr;
+    }
+    l = convertValue(l, type);
+    r = convertValue(r, type);
+    if (!l || !r) {
+        return nullptr;
+    }
+
+    // Operators of vectors apply to every lane, comparisons give a vector of 0 or 1 per lane
+    if (type->isIntOrIntVectorTy()) {
+        // Signed overflow is undefined like in C, so the optimizer may assume it doesn't happen
+        if (op == "+") {
+            return llvmBuilder.CreateNSWAdd(l, r, "addtmp");
+        } else if (op == "-") {
+            return llvmBuilder.CreateNSWSub(l, r, "subtmp");
+        } else if (op == "*") {
+            return llvmBuilder.CreateNSWMul(l, r, "multmp");
+        } else if (op == "/") {
+            return llvmBuilder.CreateSDiv(l, r, "divtmp");
+        } else if (op == "%") {
+            return llvmBuilder.CreateSRem(l, r, "remtmp");
+        } else if (op == "==") {
+            return llvmBuilder.CreateICmpEQ(l, r, "cmptmp");
+        } else if (op == "!=") {
+            return llvmBuilder.CreateICmpNE(l, r, "cmptmp");
+        } else if (op == "<") {
+            return llvmBuilder.CreateICmpSLT(l, r, "cmptmp");
+        } else if (op == "<=") {
+            return llvmBuilder.CreateICmpSLE(l, r, "cmptmp");
+        } else if (op == ">") {
+            return llvmBuilder.CreateICmpSGT(l, r, "cmptmp");
+        } else if (op == ">=") {
+            return llvmBuilder.CreateICmpSGE(l, r, "cmptmp");
+        }
+    } else if (type->isFPOrFPVectorTy()) {
+        // Comparisons with NaN are false, except for != which is true
+        if (op == "+") {
+            return llvmBuilder.CreateFAdd(l, r, "addtmp");
+        } else if (op == "-") {
+            return llvmBuilder.CreateFSub(l, r, "subtmp");
+        } else if (op == "*") {
+            return llvmBuilder.CreateFMul(l, r, "multmp");
+        } else if (op == "/") {
+            return llvmBuilder.CreateFDiv(l, r, "divtmp");
+        } else if (op == "%") {
+            return llvmBuilder.CreateFRem(l, r, "remtmp");
+        } else if (op == "==") {
+            return llvmBuilder.CreateFCmpOEQ(l, r, "cmptmp");
+        } else if (op == "!=") {
+            return llvmBuilder.CreateFCmpUNE(l, r, "cmptmp");
+        } else if (op == "<") {
+            return llvmBuilder.CreateFCmpOLT(l, r, "cmptmp");
+        } else if (op == "<=") {
+            return llvmBuilder.CreateFCmpOLE(l, r, "cmptmp");
+        } else if (op == ">") {
+            return llvmBuilder.CreateFCmpOGT(l, r, "cmptmp");
+        } else if (op == ">=") {
+            return llvmBuilder.CreateFCmpOGE(l, r, "cmptmp");
+        }
+    }
+    return nullptr;
+}
+
+// With -ffp-contract=on, a * b + c and a * b - c within one expression become llvm.fmuladd, which the
+// backend computes with a single rounding where the target has fma instructions. A product of another
+// statement reaches the sum through its local, so only products of the same expression are fused.
+inline llvm::Value *contractMulAdd(llvm::Value *value)
+{
+    auto *sum = llvm::dyn_cast<llvm::BinaryOperator>(value);
+    if (functionFpContract != FpContract::on || !sum ||
+        (sum->getOpcode() != llvm::Instruction::FAdd && sum->getOpcode() != llvm::Instruction::FSub)) {
+        return value;
+    }
+
+    for (unsigned i = 0; i < 2; ++i) {
+        auto *product = llvm::dyn_cast<llvm::BinaryOperator>(sum->getOperand(i));
+        if (!product || product->getOpcode() != llvm::Instruction::FMul || !product->hasOneUse()) {
+            continue;
+        }
+        llvm::Value *a = product->getOperand(0);
+        llvm::Value *b = product->getOperand(1);
+        llvm::Value *c = sum->getOperand(1 - i);
+        if (sum->getOpcode() == llvm::Instruction::FSub) {
+            if (i == 0) {
+                c = llvmBuilder.CreateFNeg(c);
+            } else {
+                a = llvmBuilder.CreateFNeg(a);
+            }
+        }
+        llvm::Value *fused =
+            llvmBuilder.CreateIntrinsic(llvm::Intrinsic::fmuladd, { sum->getType() }, { a, b, c }, nullptr, "fmatmp");
+        sum->eraseFromParent();
+        product->eraseFromParent();
+        return fused;
+    }
+    return value;
+}
+
 struct VariableAST : public ExprAST {
     VariableAST(const std::string &name, const std::string type)
         : name(name)
@@ -56,6 +504,11 @@ struct VariableAST : public ExprAST {
     {
     }
 
+    virtual const char *kindName() const override
+    {
+        return "Variable";
+    }
+
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
@@ -68,11 +521,21 @@ struct VariableAST : public ExprAST {
 
     llvm::Value *genUsageCode()
     {
-        llvm::Value *result = llvmNamedValues[name];
-        if (!result) {
+        llvm::AllocaInst *alloca = static_cast<llvm::AllocaInst *>(codeGenAddress());
+        if (!alloca) {
+            return nullptr;
+        }
+        return llvmBuilder.CreateLoad(alloca->getAllocatedType(), alloca, name);
+    }
+
+    virtual llvm::Value *codeGenAddress() override
+    {
+        auto it = llvmNamedValues.find(name);
+        if (it == llvmNamedValues.end()) {
             logError("Unknown variable name: " + name);
+            return nullptr;
         }
-        return result;
+        return it->second;
     }
 
     llvm::Value *genAssignmentCode()
@@ -104,6 +567,11 @@ struct BinaryOpAST : public ExprAST {
     {
     }
 
+    virtual const char *kindName() const override
+    {
+        return "BinaryOp";
+    }
+
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
@@ -115,53 +583,138 @@ struct BinaryOpAST : public ExprAST {
         return json;
     }
 
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        visitor(lhs);
+        visitor(rhs);
+    }
+
+    // Declares a new local, type name = r
     llvm::Value *handleAssignment(VariableAST *l, ExprAST *r)
     {
-        if (l->type == "float") {
-            if (llvmNamedValues.find(l->name) != llvmNamedValues.end()) {
-                logError("Named value " + l->name + "already exists");
+        llvm::Type *type = getType(l->type);
+        if (!type || type->isVoidTy()) {
+            logError("Unsupported variable type " + l->type);
+            return nullptr;
+        }
+        if (llvmNamedValues.find(l->name) != llvmNamedValues.end()) {
+            logError("Named value " + l->name + " already exists");
+            return nullptr;
+        }
+        llvm::Value *val = codeGenAs(r, type);
+        if (!val) {
+            return nullptr;
+        }
+        llvm::AllocaInst *alloca = createEntryBlockAlloca(type, l->name);
+        llvmBuilder.CreateStore(val, alloca);
+        llvmNamedValues[l->name] = alloca;
+        return val;
+    }
+
+    // Assignments to an existing local, = and the compound operators like +=
+    llvm::Value *codeGenStore()
+    {
+        llvm::Value *address = lhs->codeGenAddress();
+        if (!address) {
+            return nullptr;
+        }
+        llvm::Type *type = getElementType(address);
+
+        llvm::Value *value = nullptr;
+        if (op == "=") {
+            value = codeGenAs(rhs, type);
+        } else {
+            llvm::Value *current = llvmBuilder.CreateLoad(type, address);
+            llvm::Value *r = codeGenOperand(rhs, type);
+            if (!r) {
+                return nullptr;
+            }
+            value = createBinaryOp(op.substr(0, op.size() - 1), current, r);
+            if (!value) {
+                logError("Unsupported operand types for op " + op);
                 return nullptr;
             }
-            llvm::Value *val = r->codeGen();
-            llvmNamedValues[l->name] = val;
-            return val;
+            value = contractMulAdd(value);
+            value = convertValue(value, type);
+        }
+        if (!value) {
+            return nullptr;
+        }
+
+        llvmBuilder.CreateStore(value, address);
+        return value;
+    }
+
+    // && and || only evaluate the right side when the left one doesn't decide the result already
+    llvm::Value *codeGenLogical()
+    {
+        llvm::Value *l = codeGenCondition(lhs);
+        if (!l) {
+            return nullptr;
+        }
+
+        llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+        llvm::BasicBlock *lhsBlock = llvmBuilder.GetInsertBlock();
+        llvm::BasicBlock *rhsBlock = llvm::BasicBlock::Create(llvmContext, "logic.rhs", function);
+        llvm::BasicBlock *endBlock = llvm::BasicBlock::Create(llvmContext, "logic.end");
+        if (op == "&&") {
+            llvmBuilder.CreateCondBr(l, rhsBlock, endBlock);
         } else {
-            logError("Unsupported variable type " + l->type);
+            llvmBuilder.CreateCondBr(l, endBlock, rhsBlock);
+        }
+
+        llvmBuilder.SetInsertPoint(rhsBlock);
+        llvm::Value *r = codeGenCondition(rhs);
+        if (!r) {
             return nullptr;
         }
+        rhsBlock = llvmBuilder.GetInsertBlock();
+        llvmBuilder.CreateBr(endBlock);
+
+        endBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(endBlock);
+        llvm::PHINode *phi = llvmBuilder.CreatePHI(llvm::Type::getInt1Ty(llvmContext), 2, "logictmp");
+        phi->addIncoming(llvm::ConstantInt::get(llvm::Type::getInt1Ty(llvmContext), op == "||"), lhsBlock);
+        phi->addIncoming(r, rhsBlock);
+        return phi;
     }
 
     virtual llvm::Value *codeGen() override
     {
         if (op == "=") {
             auto *lhsVar = dynamic_cast<VariableAST *>(lhs);
-            if (!lhsVar || !rhs) {
-                return nullptr;
+            if (lhsVar && !lhsVar->type.empty()) {
+                return handleAssignment(lhsVar, rhs);
             }
-            return handleAssignment(lhsVar, rhs);
+        }
+        if (op.size() >= 1 && op.back() == '=' && !isComparisonOp(op)) {
+            return codeGenStore();
+        }
+        if (op == "&&" || op == "||") {
+            return codeGenLogical();
         }
 
-        llvm::Value *l = lhs->codeGen();
-        llvm::Value *r = rhs->codeGen();
+        auto *lhsNumber = dynamic_cast<NumberAST *>(lhs);
+        llvm::Value *l = nullptr;
+        llvm::Value *r = nullptr;
+        if (lhsNumber && !dynamic_cast<NumberAST *>(rhs)) {
+            r = rhs->codeGen();
+            l = r ? codeGenOperand(lhs, r->getType()) : nullptr;
+        } else {
+            l = lhs->codeGen();
+            r = l ? codeGenOperand(rhs, l->getType()) : nullptr;
+        }
         if (!l || !r) {
             return nullptr;
         }
 
-        llvm::Value *result {};
-        if (op == "+") {
-            result = llvmBuilder.CreateFAdd(l, r, "addtmp");
-        } else if (op == "-") {
-            result = llvmBuilder.CreateFSub(l, r, "subtmp");
-        } else if (op == "*") {
-            result = llvmBuilder.CreateFMul(l, r, "multmp");
-        } else if (op == "/") {
-            result = llvmBuilder.CreateFDiv(l, r, "divtmp");
-        } else {
-            logError("Unsupported op " + op);
+        llvm::Value *result = createBinaryOp(op, l, r);
+        if (!result) {
+            logError("Unsupported op " + op + " for its operand types");
             return nullptr;
         }
 
-        return result;
+        return contractMulAdd(result);
     }
 
     std::string op;
@@ -169,186 +722,1723 @@ struct BinaryOpAST : public ExprAST {
     ExprAST *rhs;
 };
 
-struct StatementAST : public ExprAST {
-    StatementAST(std::string statement, ExprAST *rhs)
-        : statement(statement)
-        , rhs(rhs)
+// -x and !x
+struct UnaryOpAST : public ExprAST {
+    UnaryOpAST(const std::string &op, ExprAST *operand)
+        : op(op)
+        , operand(operand)
     {
     }
 
+    virtual const char *kindName() const override
+    {
+        return "UnaryOp";
+    }
+
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
 
-        json["statement"] = statement;
-        json["rhs"] = rhs->toJson();
+        json["op"] = op;
+        json["operand"] = operand->toJson();
 
         return json;
     }
 
-    virtual llvm::Value* codeGen() override
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
     {
-        if (statement == "return") {
-            return rhs->codeGen();
-        } else {
-            logError("Invalid statement: " + statement);
+        visitor(operand);
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        llvm::Value *value = operand->codeGen();
+        if (!value) {
             return nullptr;
         }
+
+        if (op == "!") {
+            llvm::Value *condition = createCondition(value);
+            if (!condition) {
+                logError("Value cannot be used as a condition");
+                return nullptr;
+            }
+            return llvmBuilder.CreateNot(condition, "nottmp");
+        }
+
+        if (op == "-") {
+            llvm::Type *type = value->getType();
+            if (type->getScalarType()->isIntegerTy(1)) {
+                llvm::Type *intType = llvm::Type::getInt32Ty(llvmContext);
+                value = convertValue(value, type->isVectorTy() ? llvm::VectorType::get(intType, laneCount(type), false) : intType);
+            }
+            if (value->getType()->isIntOrIntVectorTy()) {
+                return llvmBuilder.CreateNSWNeg(value, "negtmp");
+            }
+            if (value->getType()->isFPOrFPVectorTy()) {
+                return llvmBuilder.CreateFNeg(value, "negtmp");
+            }
+        }
+
+        logError("Unsupported op " + op);
+        return nullptr;
     }
 
-    std::string statement;
-    ExprAST *rhs;
+    std::string op;
+    ExprAST *operand;
 };
 
-struct CallAST : public ExprAST {
-    CallAST(std::string callee, std::vector<ExprAST *> args)
-        : callee(callee)
-        , args(args)
+// Explicit conversion, (type)expr
+struct CastAST : public ExprAST {
+    CastAST(const std::string &type, ExprAST *expr)
+        : type(type)
+        , expr(expr)
     {
     }
 
+    virtual const char *kindName() const override
+    {
+        return "Cast";
+    }
+
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
 
-        json["callee"] = callee;
-
-        auto &jsonArgs = json["args"];
-        for (auto &arg : args) {
-            jsonArgs.push_back(arg->toJson());
-        }
+        json["type"] = type;
+        json["expr"] = expr->toJson();
 
         return json;
     }
 
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        visitor(expr);
+    }
+
     virtual llvm::Value *codeGen() override
     {
-        llvm::Function *func = llvmModule->getFunction(callee);
-        if (!func) {
-            logError("Unknown function referenced");
+        llvm::Type *castType = getType(type);
+        if (!castType || castType->isVoidTy()) {
+            logError("Unsupported cast type " + type);
             return nullptr;
         }
 
-        if (func->arg_size() != args.size()) {
-            logError("Incorrect number of arguments passed");
-            return nullptr;
+        // Pointers only convert to other pointers, and only explicitly
+        if (castType->isPointerTy()) {
+            llvm::Value *value = expr->codeGen();
+            if (!value) {
+                return nullptr;
+            }
+            if (!value->getType()->isPointerTy()) {
+                logError("Cannot cast a number to " + type);
+                return nullptr;
+            }
+            return llvmBuilder.CreatePointerCast(value, castType, "casttmp");
+        }
+        return codeGenAs(expr, castType);
+    }
+
+    std::string type;
+    ExprAST *expr;
+};
+
+// pointer[index], or vector[lane]
+struct IndexAST : public ExprAST {
+    IndexAST(ExprAST *base, ExprAST *index)
+        : base(base)
+        , index(index)
+    {
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "Index";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        json["base"] = base->toJson();
+        json["index"] = index->toJson();
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        visitor(base);
+        visitor(index);
+    }
+
+    llvm::Value *codeGenIndex()
+    {
+        llvm::Value *offset = index->codeGen();
+        if (!offset) {
+            return nullptr;
+        }
+        if (!offset->getType()->isIntegerTy()) {
+            logError("Index must be an integer");
+            return nullptr;
+        }
+        return convertValue(offset, llvm::Type::getInt64Ty(llvmContext));
+    }
+
+    // Indexing past the memory the pointer points into, or past the last lane, is undefined like in C
+    llvm::Value *codeGenElementAddress(llvm::Value *pointer)
+    {
+        if (!pointer->getType()->isPointerTy()) {
+            logError("Only pointers and vectors can be indexed");
+            return nullptr;
+        }
+        llvm::Value *offset = codeGenIndex();
+        if (!offset) {
+            return nullptr;
+        }
+        return llvmBuilder.CreateInBoundsGEP(getElementType(pointer), pointer, offset, "elementptr");
+    }
+
+    // Assigning to a lane writes into the vector where it is stored, which SROA turns back into
+    // an insertelement from -O1 on
+    virtual llvm::Value *codeGenAddress() override
+    {
+        if (!dynamic_cast<VariableAST *>(base) && !dynamic_cast<IndexAST *>(base)) {
+            llvm::Value *pointer = base->codeGen();
+            return pointer ? codeGenElementAddress(pointer) : nullptr;
+        }
+
+        llvm::Value *baseAddress = base->codeGenAddress();
+        if (!baseAddress) {
+            return nullptr;
+        }
+        llvm::Type *baseType = getElementType(baseAddress);
+        if (!baseType->isVectorTy()) {
+            return codeGenElementAddress(llvmBuilder.CreateLoad(baseType, baseAddress));
+        }
+
+        llvm::Value *lane = codeGenIndex();
+        if (!lane) {
+            return nullptr;
+        }
+        llvm::Value *zero = llvm::ConstantInt::get(lane->getType(), 0);
+        return llvmBuilder.CreateInBoundsGEP(baseType, baseAddress, { zero, lane }, "laneptr");
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        llvm::Value *value = base->codeGen();
+        if (!value) {
+            return nullptr;
+        }
+
+        if (value->getType()->isVectorTy()) {
+            llvm::Value *lane = codeGenIndex();
+            return lane ? llvmBuilder.CreateExtractElement(value, lane, "lane") : nullptr;
+        }
+
+        llvm::Value *address = codeGenElementAddress(value);
+        if (!address) {
+            return nullptr;
+        }
+        return llvmBuilder.CreateLoad(getElementType(address), address, "element");
+    }
+
+    ExprAST *base;
+    ExprAST *index;
+};
+
+struct StatementAST : public ExprAST {
+    StatementAST(std::string statement, ExprAST *rhs)
+        : statement(statement)
+        , rhs(rhs)
+    {
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "Statement";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        json["statement"] = statement;
+        json["rhs"] = rhs ? rhs->toJson() : nlohmann::json();
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        if (rhs) {
+            visitor(rhs);
+        }
+    }
+
+    virtual llvm::Value* codeGen() override
+    {
+        if (statement == "return") {
+            llvm::Type *returnType = llvmBuilder.GetInsertBlock()->getParent()->getReturnType();
+            if (returnType->isVoidTy() || !rhs) {
+                if (!returnType->isVoidTy() || rhs) {
+                    logError(rhs ? "A void function cannot return a value" : "Missing return value");
+                    return nullptr;
+                }
+                return llvmBuilder.CreateRetVoid();
+            }
+
+            llvm::Value *value = codeGenAs(rhs, returnType);
+            if (!value) {
+                return nullptr;
+            }
+
+            // A call right before the return is a tail call. With the same signature as the caller it
+            // is even guaranteed to be one, so that tail recursion never grows the stack, even at -O0.
+            auto *call = llvm::dyn_cast<llvm::CallInst>(value);
+            if (call && call->getCalledFunction() && !call->getCalledFunction()->isIntrinsic()) {
+                llvm::Function *caller = llvmBuilder.GetInsertBlock()->getParent();
+                bool sameSignature = call->getFunctionType() == caller->getFunctionType() &&
+                                     call->getCallingConv() == caller->getCallingConv();
+                call->setTailCallKind(sameSignature ? llvm::CallInst::TCK_MustTail : llvm::CallInst::TCK_Tail);
+            }
+
+            return llvmBuilder.CreateRet(value);
+        } else {
+            logError("Invalid statement: " + statement);
+            return nullptr;
+        }
+    }
+
+    std::string statement;
+    ExprAST *rhs; // nullptr for return in a void function
+};
+
+// Math builtins lower to LLVM intrinsics, so the optimizer can fold and vectorize them and the backend
+// emits a single instruction where the target has one. They take any numbers or vectors of numbers.
+// Integers are converted to double, except for abs, min and max, which also work on integers.
+struct MathBuiltin {
+    const char *name;
+    unsigned arity;
+    llvm::Intrinsic::ID intrinsic;
+};
+
+static const MathBuiltin mathBuiltins[] = {
+    { "sqrt", 1, llvm::Intrinsic::sqrt },
+    { "abs", 1, llvm::Intrinsic::fabs },
+    { "floor", 1, llvm::Intrinsic::floor },
+    { "ceil", 1, llvm::Intrinsic::ceil },
+    { "trunc", 1, llvm::Intrinsic::trunc },
+    { "round", 1, llvm::Intrinsic::round },
+    { "exp", 1, llvm::Intrinsic::exp },
+    { "exp2", 1, llvm::Intrinsic::exp2 },
+    { "log", 1, llvm::Intrinsic::log },
+    { "log2", 1, llvm::Intrinsic::log2 },
+    { "log10", 1, llvm::Intrinsic::log10 },
+    { "sin", 1, llvm::Intrinsic::sin },
+    { "cos", 1, llvm::Intrinsic::cos },
+    { "pow", 2, llvm::Intrinsic::pow },
+    { "min", 2, llvm::Intrinsic::minnum },
+    { "max", 2, llvm::Intrinsic::maxnum },
+    { "copysign", 2, llvm::Intrinsic::copysign },
+    { "fma", 3, llvm::Intrinsic::fma },
+};
+
+inline const MathBuiltin *findMathBuiltin(const std::string &name)
+{
+    for (auto &builtin : mathBuiltins) {
+        if (name == builtin.name) {
+            return &builtin;
+        }
+    }
+    return nullptr;
+}
+
+// sum(p, n), dot(a, b, n), min(p, n) and max(p, n) reduce the first n elements of arrays
+enum class ReductionKind { sum, dot, min, max };
+
+inline const char *reductionName(ReductionKind kind)
+{
+    switch (kind) {
+    case ReductionKind::sum:
+        return "sum";
+    case ReductionKind::dot:
+        return "dot";
+    case ReductionKind::min:
+        return "min";
+    case ReductionKind::max:
+        return "max";
+    }
+    return "";
+}
+
+// Combines two partial results, or a partial result with the next element
+inline llvm::Value *createReductionStep(llvm::IRBuilder<> &builder, ReductionKind kind, llvm::Value *acc,
+                                        llvm::Value *value)
+{
+    bool isFloat = acc->getType()->isFPOrFPVectorTy();
+    if (kind == ReductionKind::sum || kind == ReductionKind::dot) {
+        return isFloat ? builder.CreateFAdd(acc, value) : builder.CreateAdd(acc, value);
+    }
+    if (isFloat) {
+        auto intrinsic = kind == ReductionKind::min ? llvm::Intrinsic::minnum : llvm::Intrinsic::maxnum;
+        llvm::Module *module = builder.GetInsertBlock()->getModule();
+        return builder.CreateCall(llvm::Intrinsic::getDeclaration(module, intrinsic, { acc->getType() }), { acc, value });
+    }
+    llvm::Value *less = builder.CreateICmpSLT(value, acc);
+    return kind == ReductionKind::min ? builder.CreateSelect(less, value, acc) : builder.CreateSelect(less, acc, value);
+}
+
+// Adds the lanes of a vector by halving it until one lane is left
+inline llvm::Value *createHorizontalReduction(llvm::IRBuilder<> &builder, ReductionKind kind, llvm::Value *vector)
+{
+    for (unsigned lanes = laneCount(vector->getType()); lanes > 1; lanes /= 2) {
+        std::vector<uint32_t> low;
+        std::vector<uint32_t> high;
+        for (unsigned i = 0; i < lanes / 2; ++i) {
+            low.push_back(i);
+            high.push_back(lanes / 2 + i);
+        }
+        llvm::Value *undef = llvm::UndefValue::get(vector->getType());
+        llvm::Value *lowHalf = builder.CreateShuffleVector(
+            vector, undef, llvm::ConstantDataVector::get(llvmContext, llvm::ArrayRef<uint32_t>(low)));
+        llvm::Value *highHalf = builder.CreateShuffleVector(
+            vector, undef, llvm::ConstantDataVector::get(llvmContext, llvm::ArrayRef<uint32_t>(high)));
+        vector = createReductionStep(builder, kind, lowHalf, highHalf);
+    }
+    return builder.CreateExtractElement(vector, uint64_t(0));
+}
+
+// The value a reduction of no elements gives, 0 for sums and the largest or smallest value for min and max
+inline llvm::Constant *reductionIdentity(ReductionKind kind, llvm::Type *type)
+{
+    if (kind == ReductionKind::sum || kind == ReductionKind::dot) {
+        return llvm::Constant::getNullValue(type);
+    }
+    bool isMin = kind == ReductionKind::min;
+    if (type->isFloatingPointTy()) {
+        return llvm::ConstantFP::getInfinity(type, !isMin);
+    }
+    unsigned bits = type->getIntegerBitWidth();
+    return llvm::ConstantInt::get(type, isMin ? llvm::APInt::getSignedMaxValue(bits) : llvm::APInt::getSignedMinValue(bits));
+}
+
+// The reduction of a kind and element type is a function of its own that every module defines as
+// linkonce_odr, so separate modules of the same file share one copy. It keeps four accumulators of
+// 32 byte vectors, which hides the latency of the adds, combines them lane by lane once the vector
+// part is done and finishes the remaining elements one at a time. The elements are combined in another
+// order than a loop from first to last would, so float sums may round differently, but the loop is
+// vectorized without fast-math.
+inline llvm::Function *getReductionFunction(ReductionKind kind, llvm::Type *elementType)
+{
+    std::string typeName = elementType->isFloatTy() ? "float" : elementType->isDoubleTy() ? "double" :
+                           elementType->isIntegerTy(32) ? "int" : "long";
+    std::string name = std::string("cju.") + reductionName(kind) + "." + typeName;
+    if (llvm::Function *existing = llvmModule->getFunction(name)) {
+        return existing;
+    }
+
+    const unsigned accumulatorCount = 4;
+    const unsigned lanes = 32 / (elementType->getPrimitiveSizeInBits() / 8);
+    llvm::Type *vectorType = llvm::VectorType::get(elementType, lanes, false);
+    llvm::Type *sizeType = llvm::Type::getInt64Ty(llvmContext);
+    llvm::Type *pointerType = llvm::PointerType::getUnqual(elementType);
+    unsigned arrayCount = kind == ReductionKind::dot ? 2 : 1;
+
+    std::vector<llvm::Type *> paramTypes(arrayCount, pointerType);
+    paramTypes.push_back(sizeType);
+    auto *functionType = llvm::FunctionType::get(elementType, paramTypes, false);
+    llvm::Function *function =
+        llvm::Function::Create(functionType, llvm::GlobalValue::LinkOnceODRLinkage, name, llvmModule);
+    function->setVisibility(llvm::GlobalValue::HiddenVisibility);
+    for (unsigned i = 0; i < arrayCount; ++i) {
+        function->addParamAttr(i, llvm::Attribute::ReadOnly);
+        function->addParamAttr(i, llvm::Attribute::NoCapture);
+    }
+
+    llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(llvmContext, "entry", function);
+    llvm::BasicBlock *vectorBlock = llvm::BasicBlock::Create(llvmContext, "vector", function);
+    llvm::BasicBlock *vectorEndBlock = llvm::BasicBlock::Create(llvmContext, "vector.end", function);
+    llvm::BasicBlock *tailBlock = llvm::BasicBlock::Create(llvmContext, "tail", function);
+    llvm::BasicBlock *exitBlock = llvm::BasicBlock::Create(llvmContext, "exit", function);
+    llvm::IRBuilder<> builder(entryBlock);
+
+    // The partial results are reassociated on purpose, dot may also fuse its products into them
+    llvm::FastMathFlags flags;
+    flags.setAllowReassoc(true);
+    flags.setAllowContract(kind == ReductionKind::dot);
+    builder.setFastMathFlags(flags);
+
+    auto loadElements = [&](llvm::Type *type, llvm::Value *index) {
+        std::vector<llvm::Value *> values;
+        for (unsigned i = 0; i < arrayCount; ++i) {
+            llvm::Value *address = builder.CreateInBoundsGEP(elementType, function->getArg(i), index);
+            address = builder.CreatePointerCast(address, llvm::PointerType::getUnqual(type));
+            values.push_back(builder.CreateAlignedLoad(type, address, llvm::MaybeAlign(elementType->getPrimitiveSizeInBits() / 8)));
+        }
+        if (kind != ReductionKind::dot) {
+            return values[0];
+        }
+        return type->isFPOrFPVectorTy() ? builder.CreateFMul(values[0], values[1]) : builder.CreateMul(values[0], values[1]);
+    };
+
+    // A negative count reduces nothing, like a for loop up to it would
+    llvm::Value *zero = llvm::ConstantInt::get(sizeType, 0);
+    llvm::Value *count = function->getArg(arrayCount);
+    count = builder.CreateSelect(builder.CreateICmpSLT(count, zero), zero, count, "n");
+    llvm::Value *blockSize = llvm::ConstantInt::get(sizeType, lanes * accumulatorCount);
+    llvm::Value *vectorEnd = builder.CreateAnd(count, ~uint64_t(lanes * accumulatorCount - 1), "vector.count");
+    builder.CreateCondBr(builder.CreateICmpULT(zero, vectorEnd), vectorBlock, vectorEndBlock);
+
+    llvm::Constant *vectorIdentity = llvm::ConstantVector::getSplat(
+#if LLVM_VERSION_MAJOR >= 11
+        llvm::ElementCount::getFixed(lanes),
+#else
+        lanes,
+#endif
+        reductionIdentity(kind, elementType));
+    builder.SetInsertPoint(vectorBlock);
+    llvm::PHINode *index = builder.CreatePHI(sizeType, 2, "i");
+    index->addIncoming(zero, entryBlock);
+    std::vector<llvm::PHINode *> accumulators;
+    std::vector<llvm::Value *> nextAccumulators;
+    for (unsigned i = 0; i < accumulatorCount; ++i) {
+        accumulators.push_back(builder.CreatePHI(vectorType, 2, "acc"));
+        accumulators.back()->addIncoming(vectorIdentity, entryBlock);
+    }
+    for (unsigned i = 0; i < accumulatorCount; ++i) {
+        llvm::Value *offset = builder.CreateNUWAdd(index, llvm::ConstantInt::get(sizeType, i * lanes));
+        nextAccumulators.push_back(createReductionStep(builder, kind, accumulators[i], loadElements(vectorType, offset)));
+        accumulators[i]->addIncoming(nextAccumulators.back(), vectorBlock);
+    }
+    llvm::Value *nextIndex = builder.CreateNUWAdd(index, blockSize, "next");
+    index->addIncoming(nextIndex, vectorBlock);
+    builder.CreateCondBr(builder.CreateICmpULT(nextIndex, vectorEnd), vectorBlock, vectorEndBlock);
+
+    builder.SetInsertPoint(vectorEndBlock);
+    std::vector<llvm::Value *> results;
+    for (unsigned i = 0; i < accumulatorCount; ++i) {
+        llvm::PHINode *result = builder.CreatePHI(vectorType, 2);
+        result->addIncoming(vectorIdentity, entryBlock);
+        result->addIncoming(nextAccumulators[i], vectorBlock);
+        results.push_back(result);
+    }
+    llvm::Value *combined = createReductionStep(builder, kind, createReductionStep(builder, kind, results[0], results[1]),
+                                                createReductionStep(builder, kind, results[2], results[3]));
+    llvm::Value *vectorResult = createHorizontalReduction(builder, kind, combined);
+    builder.CreateCondBr(builder.CreateICmpULT(vectorEnd, count), tailBlock, exitBlock);
+
+    builder.SetInsertPoint(tailBlock);
+    llvm::PHINode *tailIndex = builder.CreatePHI(sizeType, 2, "j");
+    llvm::PHINode *tailAccumulator = builder.CreatePHI(elementType, 2, "acc");
+    tailIndex->addIncoming(vectorEnd, vectorEndBlock);
+    tailAccumulator->addIncoming(vectorResult, vectorEndBlock);
+    llvm::Value *nextTailAccumulator = createReductionStep(builder, kind, tailAccumulator, loadElements(elementType, tailIndex));
+    llvm::Value *nextTailIndex = builder.CreateNUWAdd(tailIndex, llvm::ConstantInt::get(sizeType, 1), "next");
+    tailIndex->addIncoming(nextTailIndex, tailBlock);
+    tailAccumulator->addIncoming(nextTailAccumulator, tailBlock);
+    builder.CreateCondBr(builder.CreateICmpULT(nextTailIndex, count), tailBlock, exitBlock);
+
+    builder.SetInsertPoint(exitBlock);
+    llvm::PHINode *result = builder.CreatePHI(elementType, 2, "result");
+    result->addIncoming(vectorResult, vectorEndBlock);
+    result->addIncoming(nextTailAccumulator, tailBlock);
+    builder.CreateRet(result);
+
+    verifyFunction(*function);
+    return function;
+}
+
+struct CallAST : public ExprAST {
+    CallAST(std::string callee, std::vector<ExprAST *> args)
+        : callee(callee)
+        , args(args)
+    {
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "Call";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        json["callee"] = callee;
+
+        auto &jsonArgs = json["args"];
+        for (auto &arg : args) {
+            jsonArgs.push_back(arg->toJson());
+        }
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        for (auto *arg : args) {
+            visitor(arg);
+        }
+    }
+
+    // type(lanes...) builds a vector out of one value per lane, type(value) splats a single value
+    llvm::Value *codeGenVector()
+    {
+        llvm::Type *type = getType(callee);
+        if (args.size() == 1) {
+            return codeGenAs(args[0], type);
+        }
+        if (args.size() != laneCount(type)) {
+            logError("Expected 1 or " + std::to_string(laneCount(type)) + " values for " + callee);
+            return nullptr;
+        }
+
+        llvm::Value *vector = llvm::UndefValue::get(type);
+        for (unsigned i = 0; i < args.size(); ++i) {
+            llvm::Value *element = codeGenAs(args[i], type->getScalarType());
+            if (!element) {
+                return nullptr;
+            }
+            vector = llvmBuilder.CreateInsertElement(vector, element, uint64_t(i), "vectmp");
+        }
+        return vector;
+    }
+
+    // shuffle(a, lanes...) or shuffle(a, b, lanes...) picks lanes of one vector, or of two vectors
+    // of the same type where the lanes of b come after the ones of a. The lanes are integer literals.
+    llvm::Value *codeGenShuffle()
+    {
+        if (args.size() < 2) {
+            logError("shuffle expects a vector and the lanes to pick");
+            return nullptr;
+        }
+        llvm::Value *a = args[0]->codeGen();
+        if (!a) {
+            return nullptr;
+        }
+        if (!a->getType()->isVectorTy()) {
+            logError("shuffle expects a vector");
+            return nullptr;
+        }
+
+        size_t firstLane = 1;
+        llvm::Value *b = llvm::UndefValue::get(a->getType());
+        if (!dynamic_cast<NumberAST *>(args[1])) {
+            b = args[1]->codeGen();
+            if (!b) {
+                return nullptr;
+            }
+            if (b->getType() != a->getType()) {
+                logError("Both vectors of shuffle must have the same type");
+                return nullptr;
+            }
+            ++firstLane;
+        }
+
+        int64_t inputLanes = laneCount(a->getType()) * (firstLane == 2 ? 2 : 1);
+        std::vector<uint32_t> mask;
+        for (size_t i = firstLane; i < args.size(); ++i) {
+            auto *lane = dynamic_cast<NumberAST *>(args[i]);
+            if (!lane || !lane->isInteger() || lane->intValue < 0 || lane->intValue >= inputLanes) {
+                logError("Lanes of shuffle must be integer literals from 0 to " + std::to_string(inputLanes - 1));
+                return nullptr;
+            }
+            mask.push_back(static_cast<uint32_t>(lane->intValue));
+        }
+        if (mask.empty()) {
+            logError("shuffle expects the lanes to pick");
+            return nullptr;
+        }
+
+        llvm::Value *maskValue = llvm::ConstantDataVector::get(llvmContext, llvm::ArrayRef<uint32_t>(mask));
+        return llvmBuilder.CreateShuffleVector(a, b, maskValue, "shuffletmp");
+    }
+
+    // Literal arguments take on the type of the others like operands do, so min(x, 0) stays a float for a float x.
+    // first is the value of the first argument if it was generated already.
+    llvm::Value *codeGenMath(const MathBuiltin &builtin, llvm::Value *first = nullptr)
+    {
+        if (args.size() != builtin.arity) {
+            logError(callee + " expects " + std::to_string(builtin.arity) + " argument" +
+                     (builtin.arity == 1 ? "" : "s"));
+            return nullptr;
+        }
+
+        std::vector<llvm::Value *> values(args.size());
+        llvm::Type *type = nullptr;
+        for (bool literals : { false, true }) {
+            for (size_t i = 0; i < args.size(); ++i) {
+                if ((dynamic_cast<NumberAST *>(args[i]) != nullptr) != literals) {
+                    continue;
+                }
+                values[i] = i == 0 && first ? first : codeGenOperand(args[i], type);
+                if (!values[i]) {
+                    return nullptr;
+                }
+                llvm::Type *valueType = values[i]->getType();
+                if (!valueType->isIntOrIntVectorTy() && !valueType->isFPOrFPVectorTy()) {
+                    logError(callee + " expects numbers or vectors of numbers");
+                    return nullptr;
+                }
+                type = type ? commonType(type, valueType) : valueType;
+                if (!type) {
+                    logError("Arguments of " + callee + " must have the same number of lanes");
+                    return nullptr;
+                }
+            }
+        }
+
+        bool integerOp = callee == "abs" || callee == "min" || callee == "max";
+        if (type->isIntOrIntVectorTy() && !integerOp) {
+            llvm::Type *doubleType = llvm::Type::getDoubleTy(llvmContext);
+            type = type->isVectorTy() ? llvm::VectorType::get(doubleType, laneCount(type), false) : doubleType;
+        }
+        for (auto &value : values) {
+            value = convertValue(value, type);
+        }
+
+        if (type->isIntOrIntVectorTy()) {
+            llvm::Value *a = values[0];
+            if (callee == "abs") {
+                llvm::Value *negative = llvmBuilder.CreateICmpSLT(a, llvm::Constant::getNullValue(type));
+                return llvmBuilder.CreateSelect(negative, llvmBuilder.CreateNSWNeg(a), a, "abstmp");
+            }
+            llvm::Value *b = values[1];
+            llvm::Value *less = llvmBuilder.CreateICmpSLT(a, b);
+            return callee == "min" ? llvmBuilder.CreateSelect(less, a, b, "mintmp")
+                                   : llvmBuilder.CreateSelect(less, b, a, "maxtmp");
+        }
+
+        // Called through the builder, so the call gets the fast-math flags of the function
+        llvm::Function *intrinsic = llvm::Intrinsic::getDeclaration(llvmModule, builtin.intrinsic, { type });
+        return llvmBuilder.CreateCall(intrinsic, values, callee + "tmp");
+    }
+
+    // The arrays are pointers to numbers of the same type, the count is converted to long
+    llvm::Value *codeGenReduction(ReductionKind kind, llvm::Value *first = nullptr)
+    {
+        unsigned arrayCount = kind == ReductionKind::dot ? 2 : 1;
+        if (args.size() != arrayCount + 1) {
+            logError(callee + (kind == ReductionKind::dot ? " expects two arrays" : " expects an array") +
+                     " and the number of elements");
+            return nullptr;
+        }
+
+        std::vector<llvm::Value *> values;
+        for (unsigned i = 0; i < arrayCount; ++i) {
+            values.push_back(i == 0 && first ? first : args[i]->codeGen());
+            if (!values.back()) {
+                return nullptr;
+            }
+            llvm::Type *type = values.back()->getType();
+            llvm::Type *elementType = type->isPointerTy() ? getElementType(values.back()) : nullptr;
+            if (!elementType || (!elementType->isIntegerTy() && !elementType->isFloatingPointTy())) {
+                logError(callee + " expects pointers to int, long, float or double");
+                return nullptr;
+            }
+            if (type != values[0]->getType()) {
+                logError("Both arrays of " + callee + " must have the same type");
+                return nullptr;
+            }
+        }
+        llvm::Value *count = codeGenAs(args[arrayCount], llvm::Type::getInt64Ty(llvmContext));
+        if (!count) {
+            return nullptr;
+        }
+        values.push_back(count);
+
+        llvm::Function *function = getReductionFunction(kind, getElementType(values[0]));
+        return llvmBuilder.CreateCall(function, values, callee + "tmp");
+    }
+
+    // Builtins are only used when the file doesn't declare a function of the same name
+    llvm::Value *codeGenBuiltin()
+    {
+        if (isVectorTypeName(callee)) {
+            return codeGenVector();
+        }
+        if (callee == "shuffle") {
+            return codeGenShuffle();
+        }
+        if (callee == "sum") {
+            return codeGenReduction(ReductionKind::sum);
+        }
+        if (callee == "dot") {
+            return codeGenReduction(ReductionKind::dot);
+        }
+        const MathBuiltin *builtin = findMathBuiltin(callee);
+        if (!builtin) {
+            logError("Unknown function " + callee + " referenced");
+            return nullptr;
+        }
+
+        // min(p, n) and max(p, n) of an array, which only a pointer as first argument tells apart
+        // from the minimum of two numbers
+        bool isMinMax = callee == "min" || callee == "max";
+        if (isMinMax && args.size() == 2 && !dynamic_cast<NumberAST *>(args[0])) {
+            llvm::Value *first = args[0]->codeGen();
+            if (!first) {
+                return nullptr;
+            }
+            if (first->getType()->isPointerTy()) {
+                return codeGenReduction(callee == "min" ? ReductionKind::min : ReductionKind::max, first);
+            }
+            return codeGenMath(*builtin, first);
+        }
+        return codeGenMath(*builtin);
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        llvm::Function *func = getFunction(callee);
+        if (!func) {
+            return codeGenBuiltin();
+        }
+
+        if (func->arg_size() != args.size()) {
+            logError("Incorrect number of arguments passed to " + callee);
+            return nullptr;
+        }
+
+        std::vector<llvm::Value *> argsv;
+        for (unsigned i = 0, e = args.size(); i != e; ++i) {
+            argsv.push_back(codeGenAs(args[i], func->getArg(i)->getType()));
+            if (!argsv.back()) {
+                return nullptr;
+            }
+        }
+
+        // Values of void calls can't have a name
+        return llvmBuilder.CreateCall(func, argsv, func->getReturnType()->isVoidTy() ? "" : "calltmp");
+    }
+
+    std::string callee;
+    std::vector<ExprAST *> args;
+};
+
+struct PrototypeAST : public ExprAST {
+    struct Argument {
+        std::string name;
+        std::string type;
+        bool noalias = false; // Declared restrict
+        unsigned alignment = 0; // Declared align(N), in bytes
+        bool constant = false; // Declared const, only kept for the generated C header
+    };
+
+    PrototypeAST(const std::string &name, const std::string &type, const std::vector<Argument> &args)
+        : name(name)
+        , type(type)
+        , args(args)
+    {
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "Prototype";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        json["name"] = name;
+        json["type"] = type;
+        json["static"] = internal;
+        json["simd"] = simd;
+        json["batch"] = batch;
+        json["fastmath"] = fastMath;
+        json["precise"] = precise;
+        json["fpContract"] = fpContractName(fpContract);
+
+        auto &argsJson = json["arguments"];
+        for (auto &arg : args) {
+            nlohmann::json argJson;
+            argJson["name"] = arg.name;
+            argJson["type"] = arg.type;
+            argJson["restrict"] = arg.noalias;
+            argJson["align"] = arg.alignment;
+            argJson["const"] = arg.constant;
+            argsJson.push_back(argJson);
+        }
+
+        return json;
+    }
+
+    llvm::FunctionType *codeGenType()
+    {
+        llvm::Type *returnType = getType(type);
+        if (!returnType) {
+            logError("Unsupported function return type");
+            return nullptr;
+        }
+
+        std::vector<llvm::Type *> argTypes;
+        for (auto &arg : args) {
+            llvm::Type *argType = getType(arg.type);
+            if (!argType || argType->isVoidTy()) {
+                logError("Unsupported function arg type");
+                return nullptr;
+            }
+            argTypes.push_back(argType);
+        }
+
+        return llvm::FunctionType::get(returnType, argTypes, false);
+    }
+
+    // Declares the function, static ones only become internal once FunctionAST defines them. A
+    // function that is already declared keeps its first prototype, which this one has to match.
+    virtual llvm::Function *codeGen() override
+    {
+        llvm::FunctionType *funcType = codeGenType();
+        if (!funcType) {
+            return nullptr;
+        }
+
+        auto known = functionProtos.find(name);
+        llvm::Function *func = llvmModule->getFunction(name);
+        if ((known != functionProtos.end() && known->second != this && known->second->codeGenType() != funcType)
+            || (func && func->getFunctionType() != funcType)) {
+            logError("Function " + name + " does not match its previous declaration");
+            return nullptr;
+        }
+        if (func) {
+            return func;
+        }
+
+        func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, llvmModule);
+        functionProtos.emplace(name, this);
+
+        int i = 0;
+        for (auto &arg : func->args()) {
+            arg.setName(args[i++].name);
+        }
+        addParamAttributes(*func);
+
+        return func;
+    }
+
+    // restrict pointers don't alias any other pointer the function accesses memory through, which
+    // spares the vectorizer its runtime overlap checks. align(N) tells it the address is a multiple of N.
+    void addParamAttributes(llvm::Function &func)
+    {
+        for (unsigned i = 0; i < args.size(); ++i) {
+            if (args[i].noalias) {
+                func.addParamAttr(i, llvm::Attribute::NoAlias);
+            }
+            if (args[i].alignment) {
+                func.addParamAttr(i, llvm::Attribute::getWithAlignment(llvmContext, llvm::Align(args[i].alignment)));
+            }
+        }
+    }
+
+    std::string name;
+    std::string type;
+    std::vector<Argument> args;
+    bool internal = false; // Declared static, only visible in its own file
+    bool simd = false; // Declared simd, also gets vector variants for vectorized C loops
+    bool batch = false; // Also gets a name_batch entry point over arrays, set for --batch
+    bool fastMath = false; // Declared fastmath or compiled with -ffast-math, every float operation gets the fast flags
+    bool precise = false; // Declared precise, -ffast-math and -ffp-contract don't apply
+    FpContract fpContract = FpContract::off;
+};
+
+// Looks up a function in the current module, declaring it there if it was defined in an earlier one
+inline llvm::Function *getFunction(const std::string &name)
+{
+    if (llvm::Function *func = llvmModule->getFunction(name)) {
+        return func;
+    }
+
+    auto it = functionProtos.find(name);
+    if (it != functionProtos.end()) {
+        return it->second->codeGen();
+    }
+
+    return nullptr;
+}
+
+// Suffix of the exported names of static functions, e.g. .5d41402a, which tells the statics of
+// different source files apart
+inline std::string unitSymbolSuffix(const std::string &sourceName)
+{
+    llvm::SHA1 hasher;
+    hasher.update(sourceName);
+    return "." + llvm::toHex(hasher.final(), true).substr(0, 8);
+}
+
+// Static functions have to stay visible when the functions of a file end up in separate
+// modules, like in incremental compilation and the repl. They are exported under a name unique
+// to the file, so that two files with a static function of the same name still link together.
+// Declarations of static functions from other modules of the file get the same name.
+inline void exportInternalFunctions(llvm::Module &module, const std::string &sourceName)
+{
+    std::string suffix = unitSymbolSuffix(sourceName);
+    for (auto &function : module) {
+        bool isStatic = function.hasInternalLinkage();
+        if (function.isDeclaration()) {
+            auto proto = functionProtos.find(function.getName().str());
+            isStatic = proto != functionProtos.end() && proto->second->internal;
+        }
+        if (isStatic) {
+            function.setName(function.getName() + suffix);
+            function.setLinkage(llvm::Function::ExternalLinkage);
+            function.setVisibility(llvm::GlobalValue::HiddenVisibility);
+        }
+    }
+}
+
+struct BlockAST : public ExprAST {
+    BlockAST()
+    {
+    }
+
+    void push(ExprAST *expr)
+    {
+        exprs.push_back(expr);
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "Block";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        auto &exprsJson = json["exprs"];
+        for (auto *expr : exprs) {
+            nlohmann::json exprJson;
+            exprJson = expr->toJson();
+            exprsJson.push_back(exprJson);
+        }
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        for (auto *expr : exprs) {
+            visitor(expr);
+        }
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        // Locals declared in the block go out of scope at its end
+        auto outerNamedValues = llvmNamedValues;
+        bool success = true;
+        for (auto *expr : exprs) {
+            // Anything after a return is unreachable and not generated
+            if (isInsertBlockTerminated()) {
+                break;
+            }
+            if (!expr->codeGen()) {
+                success = false;
+                break;
+            }
+        }
+        llvmNamedValues = outerNamedValues;
+        return success ? statementSuccess() : nullptr;
+    }
+
+    std::vector<ExprAST *> exprs;
+};
+
+struct IfAST : public ExprAST {
+    IfAST(ExprAST *cond, ExprAST *thenBody, ExprAST *elseBody)
+        : cond(cond)
+        , thenBody(thenBody)
+        , elseBody(elseBody)
+    {
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "If";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        json["cond"] = cond->toJson();
+        json["then"] = thenBody->toJson();
+        json["else"] = elseBody ? elseBody->toJson() : nlohmann::json();
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        visitor(cond);
+        visitor(thenBody);
+        if (elseBody) {
+            visitor(elseBody);
+        }
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        llvm::Value *condition = codeGenCondition(cond);
+        if (!condition) {
+            return nullptr;
+        }
+
+        llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+        llvm::BasicBlock *thenBlock = llvm::BasicBlock::Create(llvmContext, "if.then", function);
+        llvm::BasicBlock *elseBlock = elseBody ? llvm::BasicBlock::Create(llvmContext, "if.else") : nullptr;
+        llvm::BasicBlock *endBlock = llvm::BasicBlock::Create(llvmContext, "if.end");
+        createCondBr(condition, thenBlock, elseBlock ? elseBlock : endBlock);
+
+        llvmBuilder.SetInsertPoint(thenBlock);
+        if (!thenBody->codeGen()) {
+            return nullptr;
+        }
+        if (!isInsertBlockTerminated()) {
+            llvmBuilder.CreateBr(endBlock);
+        }
+
+        if (elseBlock) {
+            elseBlock->insertInto(function);
+            llvmBuilder.SetInsertPoint(elseBlock);
+            if (!elseBody->codeGen()) {
+                return nullptr;
+            }
+            if (!isInsertBlockTerminated()) {
+                llvmBuilder.CreateBr(endBlock);
+            }
+        }
+
+        endBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(endBlock);
+        return statementSuccess();
+    }
+
+    ExprAST *cond;
+    ExprAST *thenBody;
+    ExprAST *elseBody; // nullptr without an else
+};
+
+// Optimization hints of a loop from #pragma lines in front of it, e.g. #pragma unroll(4) vectorize(8).
+// They become llvm.loop metadata on the back edge, which the loop passes read from -O1 on.
+struct LoopHints {
+    bool unroll = false;
+    unsigned unrollCount = 0; // 0 lets the unroller pick, 1 disables unrolling
+    bool vectorize = false;
+    unsigned vectorizeWidth = 0; // 0 lets the vectorizer pick, 1 disables vectorization
+    unsigned interleaveCount = 0;
+    bool distribute = false;
+
+    bool empty() const
+    {
+        return !unroll && !vectorize && !interleaveCount && !distribute;
+    }
+
+    nlohmann::json toJson() const
+    {
+        nlohmann::json json = nlohmann::json::object();
+        if (unroll) {
+            json["unroll"] = unrollCount;
+        }
+        if (vectorize) {
+            json["vectorize"] = vectorizeWidth;
+        }
+        if (interleaveCount) {
+            json["interleave"] = interleaveCount;
+        }
+        if (distribute) {
+            json["distribute"] = true;
+        }
+        return json;
+    }
+
+    // Loop id with a hint per pragma, the way clang writes its loop pragmas
+    llvm::MDNode *codeGen() const
+    {
+        if (empty()) {
+            return nullptr;
+        }
+
+        // The first operand of a loop id is the node itself, which keeps distinct loops apart
+        std::vector<llvm::Metadata *> operands = { nullptr };
+        auto addHint = [&](const char *name, llvm::Constant *value = nullptr) {
+            std::vector<llvm::Metadata *> hint = { llvm::MDString::get(llvmContext, name) };
+            if (value) {
+                hint.push_back(llvm::ConstantAsMetadata::get(value));
+            }
+            operands.push_back(llvm::MDNode::get(llvmContext, hint));
+        };
+        llvm::Type *int32Type = llvm::Type::getInt32Ty(llvmContext);
+
+        if (unroll) {
+            if (unrollCount == 1) {
+                addHint("llvm.loop.unroll.disable");
+            } else if (unrollCount) {
+                addHint("llvm.loop.unroll.count", llvm::ConstantInt::get(int32Type, unrollCount));
+            } else {
+                addHint("llvm.loop.unroll.enable");
+            }
         }
-
-        std::vector<llvm::Value *> argsv;
-        for (unsigned i = 0, e = args.size(); i != e; ++i) {
-            argsv.push_back(args[i]->codeGen());
-            if (!argsv.back()) {
-                return nullptr;
+        if (vectorize) {
+            if (vectorizeWidth) {
+                addHint("llvm.loop.vectorize.width", llvm::ConstantInt::get(int32Type, vectorizeWidth));
             }
+            addHint("llvm.loop.vectorize.enable", llvm::ConstantInt::getBool(llvmContext, vectorizeWidth != 1));
+        }
+        if (interleaveCount) {
+            addHint("llvm.loop.interleave.count", llvm::ConstantInt::get(int32Type, interleaveCount));
+        }
+        if (distribute) {
+            addHint("llvm.loop.distribute.enable", llvm::ConstantInt::getTrue(llvmContext));
         }
 
-        return llvmBuilder.CreateCall(func, argsv, "calltmp");
+        llvm::MDNode *loopId = llvm::MDNode::getDistinct(llvmContext, operands);
+        loopId->replaceOperandWith(0, loopId);
+        return loopId;
     }
 
-    std::string callee;
-    std::vector<ExprAST *> args;
+    void attachTo(llvm::Instruction *backEdge) const
+    {
+        if (llvm::MDNode *loopId = codeGen()) {
+            backEdge->setMetadata(llvm::LLVMContext::MD_loop, loopId);
+        }
+    }
 };
 
-struct PrototypeAST : public ExprAST {
-    struct Argument {
-        std::string name;
-        std::string type;
-    };
+struct WhileAST : public ExprAST {
+    WhileAST(ExprAST *cond, ExprAST *body)
+        : cond(cond)
+        , body(body)
+    {
+    }
 
-    PrototypeAST(const std::string &name, const std::string &type, const std::vector<Argument> &args)
-        : name(name)
-        , type(type)
-        , args(args)
+    virtual const char *kindName() const override
     {
+        return "While";
     }
 
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
 
-        json["name"] = name;
-        json["type"] = type;
-
-        auto &argsJson = json["arguments"];
-        for (auto &arg : args) {
-            nlohmann::json argJson;
-            argJson["name"] = arg.name;
-            argJson["type"] = arg.type;
-            argsJson.push_back(argJson);
+        json["cond"] = cond->toJson();
+        json["body"] = body->toJson();
+        if (!hints.empty()) {
+            json["hints"] = hints.toJson();
         }
 
         return json;
     }
 
-    virtual llvm::Function *codeGen() override
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
     {
-        if (type != "float") {
-            logError("Unsupported function return type");
+        visitor(cond);
+        visitor(body);
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+        llvm::BasicBlock *condBlock = llvm::BasicBlock::Create(llvmContext, "while.cond", function);
+        llvm::BasicBlock *bodyBlock = llvm::BasicBlock::Create(llvmContext, "while.body");
+        llvm::BasicBlock *endBlock = llvm::BasicBlock::Create(llvmContext, "while.end");
+        llvmBuilder.CreateBr(condBlock);
+
+        llvmBuilder.SetInsertPoint(condBlock);
+        llvm::Value *condition = codeGenCondition(cond);
+        if (!condition) {
             return nullptr;
         }
+        createCondBr(condition, bodyBlock, endBlock);
 
-        for (auto &arg : args) {
-            if (arg.type != "float") {
-                logError("Unsupported function arg type");
-                return nullptr;
-            }
+        bodyBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(bodyBlock);
+        if (!body->codeGen()) {
+            return nullptr;
         }
-
-        std::vector<llvm::Type *> argTypes(args.size(), llvm::Type::getFloatTy(llvmContext));
-        llvm::FunctionType *funcType =
-            llvm::FunctionType::get(llvm::Type::getFloatTy(llvmContext), argTypes, false);
-
-        llvm::Function *func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, llvmModule);
-
-        int i = 0;
-        for (auto &arg : func->args()) {
-            arg.setName(args[i++].name);
+        if (!isInsertBlockTerminated()) {
+            hints.attachTo(llvmBuilder.CreateBr(condBlock));
         }
 
-        return func;
+        endBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(endBlock);
+        return statementSuccess();
     }
 
-    std::string name;
-    std::string type;
-    std::vector<Argument> args;
+    ExprAST *cond;
+    ExprAST *body;
+    LoopHints hints;
 };
 
-struct BlockAST : public ExprAST {
-    BlockAST()
+// for (init; cond; step) body, any of init, cond and step may be left out. parallel for runs the
+// iterations on the thread pool of the runtime library, see src/runtime.h.
+struct ForAST : public ExprAST {
+    ForAST(ExprAST *init, ExprAST *cond, ExprAST *step, ExprAST *body, bool parallel = false)
+        : init(init)
+        , cond(cond)
+        , step(step)
+        , body(body)
+        , parallel(parallel)
     {
     }
 
-    void push(ExprAST *expr)
+    virtual const char *kindName() const override
     {
-        exprs.push_back(expr);
+        return "For";
     }
 
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
 
-        auto &exprsJson = json["exprs"];
-        for (auto *expr : exprs) {
-            nlohmann::json exprJson;
-            exprJson = expr->toJson();
-            exprsJson.push_back(exprJson);
+        json["init"] = init ? init->toJson() : nlohmann::json();
+        json["cond"] = cond ? cond->toJson() : nlohmann::json();
+        json["step"] = step ? step->toJson() : nlohmann::json();
+        json["body"] = body->toJson();
+        json["parallel"] = parallel;
+        if (!hints.empty()) {
+            json["hints"] = hints.toJson();
         }
 
         return json;
     }
 
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        for (auto *child : { init, cond, step, body }) {
+            if (child) {
+                visitor(child);
+            }
+        }
+    }
+
     virtual llvm::Value *codeGen() override
     {
-        llvm::Value *lastValue = nullptr;
-        for (auto *expr : exprs) {
-            lastValue = expr->codeGen();
+        // A variable declared in init is only visible in the loop
+        auto outerNamedValues = llvmNamedValues;
+        bool success = parallel ? codeGenParallel() : codeGenLoop();
+        llvmNamedValues = outerNamedValues;
+        return success ? statementSuccess() : nullptr;
+    }
+
+    bool codeGenLoop()
+    {
+        if (init && !init->codeGen()) {
+            return false;
+        }
+
+        llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+        llvm::BasicBlock *condBlock = llvm::BasicBlock::Create(llvmContext, "for.cond", function);
+        llvm::BasicBlock *bodyBlock = llvm::BasicBlock::Create(llvmContext, "for.body");
+        llvm::BasicBlock *stepBlock = llvm::BasicBlock::Create(llvmContext, "for.step");
+        llvm::BasicBlock *endBlock = llvm::BasicBlock::Create(llvmContext, "for.end");
+        llvmBuilder.CreateBr(condBlock);
+
+        llvmBuilder.SetInsertPoint(condBlock);
+        if (cond) {
+            llvm::Value *condition = codeGenCondition(cond);
+            if (!condition) {
+                return false;
+            }
+            createCondBr(condition, bodyBlock, endBlock);
+        } else {
+            llvmBuilder.CreateBr(bodyBlock);
+        }
+
+        bodyBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(bodyBlock);
+        if (!body->codeGen()) {
+            return false;
+        }
+        if (!isInsertBlockTerminated()) {
+            llvmBuilder.CreateBr(stepBlock);
         }
-        return lastValue;
+
+        stepBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(stepBlock);
+        if (step && !step->codeGen()) {
+            return false;
+        }
+        hints.attachTo(llvmBuilder.CreateBr(condBlock));
+
+        endBlock->insertInto(function);
+        llvmBuilder.SetInsertPoint(endBlock);
+        return true;
     }
 
-    std::vector<ExprAST *> exprs;
+    // The trip count of a parallel for has to be known before it starts, so it only takes
+    // for (int i = begin; i < end; i++) with an int or long i, or i += 1 as the step
+    VariableAST *parallelLoopVariable() const
+    {
+        auto *initOp = dynamic_cast<BinaryOpAST *>(init);
+        auto *variable = initOp && initOp->op == "=" ? dynamic_cast<VariableAST *>(initOp->lhs) : nullptr;
+        if (!variable || (variable->type != "int" && variable->type != "long")) {
+            return nullptr;
+        }
+
+        auto isVariable = [&](ExprAST *expr) {
+            auto *use = dynamic_cast<VariableAST *>(expr);
+            return use && use->type.empty() && use->name == variable->name;
+        };
+        auto *condOp = dynamic_cast<BinaryOpAST *>(cond);
+        auto *stepOp = dynamic_cast<BinaryOpAST *>(step);
+        auto *stepValue = stepOp ? dynamic_cast<NumberAST *>(stepOp->rhs) : nullptr;
+        if (!condOp || condOp->op != "<" || !isVariable(condOp->lhs) || !stepOp || stepOp->op != "+=" ||
+            !isVariable(stepOp->lhs) || !stepValue || !stepValue->isInteger() || stepValue->intValue != 1) {
+            return nullptr;
+        }
+        return variable;
+    }
+
+    // Names the body reads, and whether it returns
+    static void scanParallelBody(ExprAST *node, std::set<std::string> &names, bool &returns)
+    {
+        if (auto *variable = dynamic_cast<VariableAST *>(node)) {
+            if (variable->type.empty()) {
+                names.insert(variable->name);
+            }
+        }
+        if (auto *statement = dynamic_cast<StatementAST *>(node)) {
+            returns |= statement->statement == "return";
+        }
+        node->visitChildren([&](ExprAST *child) { scanParallelBody(child, names, returns); });
+    }
+
+    // Stores to the local, including the ones to single lanes of a vector
+    static unsigned countStores(llvm::AllocaInst *local)
+    {
+        unsigned stores = 0;
+        for (auto *user : local->users()) {
+            if (auto *store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+                stores += store->getPointerOperand() == local;
+            } else if (llvm::isa<llvm::GetElementPtrInst>(user)) {
+                for (auto *laneUser : user->users()) {
+                    stores += llvm::isa<llvm::StoreInst>(laneUser);
+                }
+            }
+        }
+        return stores;
+    }
+
+    // The body is outlined into a function over a range of iterations that the runtime calls from its
+    // threads. The locals of the enclosing function the body reads are copied into a context for it.
+    bool codeGenParallel()
+    {
+        VariableAST *variable = parallelLoopVariable();
+        if (!variable) {
+            logError("parallel for must have the form for (int i = begin; i < end; i++)");
+            return false;
+        }
+        if (llvmNamedValues.find(variable->name) != llvmNamedValues.end()) {
+            logError("Named value " + variable->name + " already exists");
+            return false;
+        }
+
+        std::set<std::string> names;
+        bool returns = false;
+        scanParallelBody(body, names, returns);
+        if (returns) {
+            logError("Cannot return from within a parallel for");
+            return false;
+        }
+
+        // The bounds are evaluated once, before any iteration runs
+        llvm::Type *variableType = getType(variable->type);
+        llvm::Type *int64Type = llvm::Type::getInt64Ty(llvmContext);
+        llvm::Value *begin = codeGenAs(static_cast<BinaryOpAST *>(init)->rhs, variableType);
+        if (!begin) {
+            return false;
+        }
+        llvm::Value *end = static_cast<BinaryOpAST *>(cond)->rhs->codeGen();
+        if (!end) {
+            return false;
+        }
+        if (!end->getType()->isIntegerTy()) {
+            logError("The end of a parallel for must be an int or long");
+            return false;
+        }
+        begin = convertValue(begin, int64Type);
+        end = convertValue(end, int64Type);
+
+        std::vector<std::string> captureNames;
+        std::vector<llvm::Type *> captureTypes;
+        for (auto &name : names) {
+            auto it = llvmNamedValues.find(name);
+            if (it != llvmNamedValues.end()) {
+                captureNames.push_back(name);
+                captureTypes.push_back(it->second->getAllocatedType());
+            }
+        }
+        llvm::Type *bytePointerType = llvm::Type::getInt8PtrTy(llvmContext);
+        llvm::StructType *contextType = llvm::StructType::get(llvmContext, captureTypes);
+        llvm::Value *context = llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(bytePointerType));
+        if (!captureNames.empty()) {
+            llvm::AllocaInst *contextAlloca = createEntryBlockAlloca(contextType, "parallel.context");
+            for (unsigned i = 0; i < captureNames.size(); ++i) {
+                llvm::AllocaInst *local = llvmNamedValues[captureNames[i]];
+                llvm::Value *value = llvmBuilder.CreateLoad(local->getAllocatedType(), local, captureNames[i]);
+                llvmBuilder.CreateStore(value, llvmBuilder.CreateStructGEP(contextType, contextAlloca, i));
+            }
+            context = llvmBuilder.CreateBitCast(contextAlloca, bytePointerType);
+        }
+
+        // void body(long begin, long end, void *context), with the float semantics of the enclosing function
+        llvm::Function *function = llvmBuilder.GetInsertBlock()->getParent();
+        llvm::FunctionType *bodyType = llvm::FunctionType::get(llvm::Type::getVoidTy(llvmContext),
+                                                               { int64Type, int64Type, bytePointerType }, false);
+        llvm::Function *outlined = llvm::Function::Create(bodyType, llvm::Function::InternalLinkage,
+                                                          function->getName() + ".parallel", llvmModule);
+        for (const char *name : { "unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math", "no-signed-zeros-fp-math" }) {
+            if (function->hasFnAttribute(name)) {
+                outlined->addFnAttr(function->getFnAttribute(name));
+            }
+        }
+
+        llvm::BasicBlock *block = llvmBuilder.GetInsertBlock();
+        bool success = codeGenParallelBody(*outlined, variable->name, variableType, captureNames, contextType);
+        llvmBuilder.SetInsertPoint(block);
+        if (!success) {
+            outlined->eraseFromParent();
+            return false;
+        }
+
+        llvm::FunctionCallee parallelFor = llvmModule->getOrInsertFunction(
+            "cju_parallel_for", llvm::Type::getVoidTy(llvmContext), int64Type, int64Type,
+            llvm::PointerType::getUnqual(bodyType), bytePointerType);
+        llvmBuilder.CreateCall(parallelFor, { begin, end, outlined, context });
+        return true;
+    }
+
+    bool codeGenParallelBody(llvm::Function &outlined, const std::string &variableName, llvm::Type *variableType,
+                             const std::vector<std::string> &captureNames, llvm::StructType *contextType)
+    {
+        auto argument = outlined.arg_begin();
+        llvm::Argument *begin = &*argument++;
+        llvm::Argument *end = &*argument++;
+        llvm::Argument *context = &*argument;
+        begin->setName("begin");
+        end->setName("end");
+        context->setName("context");
+
+        llvmBuilder.SetInsertPoint(llvm::BasicBlock::Create(llvmContext, "entry", &outlined));
+        llvmNamedValues.clear();
+        if (!captureNames.empty()) {
+            llvm::Value *captures = llvmBuilder.CreateBitCast(context, llvm::PointerType::getUnqual(contextType));
+            for (unsigned i = 0; i < captureNames.size(); ++i) {
+                llvm::Type *type = contextType->getElementType(i);
+                llvm::AllocaInst *local = createEntryBlockAlloca(type, captureNames[i]);
+                llvm::Value *value = llvmBuilder.CreateLoad(type, llvmBuilder.CreateStructGEP(contextType, captures, i));
+                llvmBuilder.CreateStore(value, local);
+                llvmNamedValues[captureNames[i]] = local;
+            }
+        }
+        llvm::AllocaInst *counter = createEntryBlockAlloca(variableType, variableName);
+        llvmBuilder.CreateStore(convertValue(begin, variableType), counter);
+        llvmNamedValues[variableName] = counter;
+        llvm::Value *last = convertValue(end, variableType);
+
+        llvm::BasicBlock *condBlock = llvm::BasicBlock::Create(llvmContext, "for.cond", &outlined);
+        llvm::BasicBlock *bodyBlock = llvm::BasicBlock::Create(llvmContext, "for.body");
+        llvm::BasicBlock *stepBlock = llvm::BasicBlock::Create(llvmContext, "for.step");
+        llvm::BasicBlock *endBlock = llvm::BasicBlock::Create(llvmContext, "for.end");
+        llvmBuilder.CreateBr(condBlock);
+
+        llvmBuilder.SetInsertPoint(condBlock);
+        llvm::Value *index = llvmBuilder.CreateLoad(variableType, counter, variableName);
+        llvmBuilder.CreateCondBr(llvmBuilder.CreateICmpSLT(index, last), bodyBlock, endBlock);
+
+        bodyBlock->insertInto(&outlined);
+        llvmBuilder.SetInsertPoint(bodyBlock);
+        if (!body->codeGen()) {
+            return false;
+        }
+        if (!isInsertBlockTerminated()) {
+            llvmBuilder.CreateBr(stepBlock);
+        }
+
+        // Every thread has its own copy of the locals, so writes to them would be lost. The block of the
+        // body has ended its scope, which leaves the captures and the loop variable.
+        for (auto &entry : llvmNamedValues) {
+            if (countStores(entry.second) > 1) {
+                logError(entry.first == variableName
+                             ? "parallel for cannot assign to its loop variable " + variableName
+                             : "parallel for cannot assign to " + entry.first + ", it is shared by all iterations");
+                return false;
+            }
+        }
+
+        stepBlock->insertInto(&outlined);
+        llvmBuilder.SetInsertPoint(stepBlock);
+        index = llvmBuilder.CreateLoad(variableType, counter, variableName);
+        llvmBuilder.CreateStore(llvmBuilder.CreateNSWAdd(index, llvm::ConstantInt::get(variableType, 1)), counter);
+        hints.attachTo(llvmBuilder.CreateBr(condBlock));
+
+        endBlock->insertInto(&outlined);
+        llvmBuilder.SetInsertPoint(endBlock);
+        llvmBuilder.CreateRetVoid();
+
+        promoteLocals(outlined);
+        verifyFunction(outlined);
+        return true;
+    }
+
+    ExprAST *init; // nullptr when left out, like cond and step
+    ExprAST *cond;
+    ExprAST *step;
+    ExprAST *body;
+    bool parallel;
+    LoopHints hints;
+};
+
+// Vector variants of a simd function after the x86 vector function ABI, so that C compilers can call
+// them from vectorized loops for a function declared with #pragma omp declare simd notinbranch.
+// Every ISA has its own register sizes for floating point and integer types.
+struct SimdCloneIsa {
+    char letter;
+    unsigned floatBits;
+    unsigned intBits;
+    const char *targetFeatures;
+};
+
+static const SimdCloneIsa simdCloneIsas[] = {
+    { 'b', 128, 128, "+sse2" }, // SSE
+    { 'c', 256, 128, "+avx" }, // AVX
+    { 'd', 256, 256, "+avx,+avx2" }, // AVX2
+    { 'e', 512, 512, "+avx512f" }, // AVX-512
 };
 
+// Every lane calls the scalar function. The calls are inlined from -O1 on, after which the SLP
+// vectorizer merges the lanes back into vector instructions.
+inline llvm::Function *createSimdClone(llvm::Function &function, const SimdCloneIsa &isa)
+{
+    // The lane count follows from the return type, the characteristic data type of the ABI
+    llvm::Type *returnType = function.getReturnType();
+    unsigned registerBits = returnType->isFloatingPointTy() ? isa.floatBits : isa.intBits;
+    unsigned lanes = registerBits / returnType->getPrimitiveSizeInBits();
+
+    // A parameter wider than a register of its kind is passed in several registers, like consecutive
+    // parameters. LLVM would pass an <8 x i32> in one ymm register with AVX, where the ABI has AVX
+    // pass integers in xmm halves, so such parameters are split into registers explicitly.
+    std::vector<llvm::Type *> paramTypes;
+    std::vector<unsigned> firstParams;
+    std::vector<unsigned> partLanes;
+    for (auto &arg : function.args()) {
+        llvm::Type *type = arg.getType();
+        unsigned bits = type->isFloatingPointTy() ? isa.floatBits : isa.intBits;
+        firstParams.push_back(paramTypes.size());
+        partLanes.push_back(std::min(lanes, bits / static_cast<unsigned>(type->getPrimitiveSizeInBits())));
+        for (unsigned part = 0; part < lanes / partLanes.back(); ++part) {
+            paramTypes.push_back(llvm::VectorType::get(type, partLanes.back(), false));
+        }
+    }
+    llvm::Type *vectorReturnType = llvm::VectorType::get(returnType, lanes, false);
+    auto *cloneType = llvm::FunctionType::get(vectorReturnType, paramTypes, false);
+
+    // _ZGV, ISA, unmasked, lane count, a v for every vector parameter, _ and the scalar name
+    std::string name = std::string("_ZGV") + isa.letter + "N" + std::to_string(lanes) +
+                       std::string(function.arg_size(), 'v') + "_" + function.getName().str();
+    llvm::Function *clone = llvm::Function::Create(cloneType, function.getLinkage(), name, function.getParent());
+    clone->addFnAttr("target-features", isa.targetFeatures);
+
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(llvmContext, "entry", clone));
+    llvm::Value *result = llvm::UndefValue::get(vectorReturnType);
+    for (unsigned lane = 0; lane < lanes; ++lane) {
+        std::vector<llvm::Value *> args;
+        for (unsigned i = 0; i < function.arg_size(); ++i) {
+            llvm::Value *part = clone->getArg(firstParams[i] + lane / partLanes[i]);
+            args.push_back(builder.CreateExtractElement(part, uint64_t(lane % partLanes[i])));
+        }
+        llvm::CallInst *call = builder.CreateCall(&function, args);
+        call->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
+        result = builder.CreateInsertElement(result, call, uint64_t(lane));
+    }
+    builder.CreateRet(result);
+
+    verifyFunction(*clone);
+    return clone;
+}
+
+// name_batch(const T1 *a, const T2 *b, R *out, size_t n) applies a scalar function to n elements of
+// arrays. All arrays are noalias, so once the call is inlined the loop vectorizes without overlap checks.
+inline llvm::Function *createBatchFunction(llvm::Function &function)
+{
+    std::string name = function.getName().str() + "_batch";
+    if (function.getParent()->getFunction(name)) {
+        return nullptr;
+    }
+
+    // size_t of 64 bit targets
+    llvm::Type *sizeType = llvm::Type::getInt64Ty(llvmContext);
+    llvm::Type *returnType = function.getReturnType();
+    unsigned arity = function.arg_size();
+
+    std::vector<llvm::Type *> paramTypes;
+    for (auto &arg : function.args()) {
+        paramTypes.push_back(llvm::PointerType::getUnqual(arg.getType()));
+    }
+    paramTypes.push_back(llvm::PointerType::getUnqual(returnType));
+    paramTypes.push_back(sizeType);
+    auto *batchType = llvm::FunctionType::get(llvm::Type::getVoidTy(llvmContext), paramTypes, false);
+    llvm::Function *batch = llvm::Function::Create(batchType, function.getLinkage(), name, function.getParent());
+
+    for (unsigned i = 0; i <= arity; ++i) {
+        batch->addParamAttr(i, llvm::Attribute::NoAlias);
+        if (i < arity) {
+            batch->addParamAttr(i, llvm::Attribute::ReadOnly);
+            batch->getArg(i)->setName(function.getArg(i)->getName());
+        }
+    }
+    llvm::Value *out = batch->getArg(arity);
+    llvm::Value *count = batch->getArg(arity + 1);
+    out->setName("out");
+    count->setName("n");
+
+    llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(llvmContext, "entry", batch);
+    llvm::BasicBlock *loopBlock = llvm::BasicBlock::Create(llvmContext, "loop", batch);
+    llvm::BasicBlock *exitBlock = llvm::BasicBlock::Create(llvmContext, "exit", batch);
+    llvm::IRBuilder<> builder(entryBlock);
+    llvm::Value *zero = llvm::ConstantInt::get(sizeType, 0);
+    builder.CreateCondBr(builder.CreateICmpEQ(count, zero), exitBlock, loopBlock);
+
+    builder.SetInsertPoint(loopBlock);
+    llvm::PHINode *index = builder.CreatePHI(sizeType, 2, "i");
+    index->addIncoming(zero, entryBlock);
+    std::vector<llvm::Value *> args;
+    for (unsigned i = 0; i < arity; ++i) {
+        llvm::Type *argType = function.getArg(i)->getType();
+        llvm::Value *address = builder.CreateInBoundsGEP(argType, batch->getArg(i), index);
+        args.push_back(builder.CreateLoad(argType, address));
+    }
+    llvm::CallInst *call = builder.CreateCall(&function, args);
+    call->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
+    builder.CreateStore(call, builder.CreateInBoundsGEP(returnType, out, index));
+
+    llvm::Value *next = builder.CreateNUWAdd(index, llvm::ConstantInt::get(sizeType, 1), "next");
+    index->addIncoming(next, loopBlock);
+    builder.CreateCondBr(builder.CreateICmpULT(next, count), loopBlock, exitBlock);
+
+    builder.SetInsertPoint(exitBlock);
+    builder.CreateRetVoid();
+
+    verifyFunction(*batch);
+    return batch;
+}
+
+// Only functions of numbers have clones, other types have no vector form in the ABI
+inline bool canHaveSimdClones(llvm::Function &function)
+{
+    auto isNumber = [](llvm::Type *type) { return type->isIntegerTy() || type->isFloatingPointTy(); };
+    for (auto &arg : function.args()) {
+        if (!isNumber(arg.getType())) {
+            return false;
+        }
+    }
+    return isNumber(function.getReturnType());
+}
+
 struct FunctionAST : public ExprAST {
     FunctionAST(PrototypeAST *proto, ExprAST *body)
         : proto(proto)
@@ -356,6 +2446,11 @@ struct FunctionAST : public ExprAST {
     {
     }
 
+    virtual const char *kindName() const override
+    {
+        return "Function";
+    }
+
     virtual nlohmann::json toJson() override
     {
         nlohmann::json json;
@@ -366,8 +2461,16 @@ struct FunctionAST : public ExprAST {
         return json;
     }
 
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        visitor(proto);
+        visitor(body);
+    }
+
     virtual llvm::Value *codeGen() override
     {
+        PhaseTimer timer("codeGenFunction", proto->name);
+
         // First, check for an existing function from a previous 'extern' declaration.
         llvm::Function *function = llvmModule->getFunction(proto->name);
 
@@ -379,25 +2482,210 @@ struct FunctionAST : public ExprAST {
             return nullptr;
         }
 
+        if (!function->empty()) {
+            logError("Function " + proto->name + " cannot be redefined");
+            return nullptr;
+        }
+        if (proto->simd && !canHaveSimdClones(*function)) {
+            logError("simd function " + proto->name + " must take and return int, long, float or double");
+            return nullptr;
+        }
+
+        if (function->getFunctionType() != proto->codeGenType()) {
+            logError("Function " + proto->name + " does not match its previous declaration");
+            return nullptr;
+        }
+        // Only once the definition is accepted, a rejected one must not replace the first
+        functionProtos[proto->name] = proto;
+        if (proto->internal) {
+            function->setLinkage(llvm::Function::InternalLinkage);
+        }
+        proto->addParamAttributes(*function);
+
+        // The declaration may have come from an extern with different argument names,
+        // the body refers to the names given in this definition.
+        unsigned argIndex = 0;
+        for (auto &arg : function->args()) {
+            arg.setName(proto->args[argIndex++].name);
+        }
+
+        // The float semantics of the function apply to every operation of its body
+        llvm::IRBuilderBase::FastMathFlagGuard fastMathGuard(llvmBuilder);
+        llvmBuilder.setFastMathFlags(fastMathFlags());
+        functionFpContract = proto->fpContract;
+        addFloatAttributes(*function);
+
         llvm::BasicBlock *basicBlock = llvm::BasicBlock::Create(llvmContext, "entry", function);
         llvmBuilder.SetInsertPoint(basicBlock);
 
+        // Arguments are mutable locals like any other
         llvmNamedValues.clear();
-        for (auto &Arg : function->args())
-            llvmNamedValues[Arg.getName()] = &Arg;
+        for (auto &arg : function->args()) {
+            llvm::AllocaInst *alloca = createEntryBlockAlloca(arg.getType(), arg.getName().str());
+            llvmBuilder.CreateStore(&arg, alloca);
+            llvmNamedValues[arg.getName().str()] = alloca;
+        }
+
+        // Functions generated before may already call this one, so a failed body leaves a declaration
+        if (!body->codeGen()) {
+            function->deleteBody();
+            return nullptr;
+        }
 
-        if (llvm::Value *retVal = body->codeGen()) {
-            llvmBuilder.CreateRet(retVal);
-            verifyFunction(*function);
-            return function;
+        // Code after the last statement is only reachable if some path doesn't return
+        llvm::BasicBlock *lastBlock = llvmBuilder.GetInsertBlock();
+        if (!lastBlock->getTerminator()) {
+            if (function->getReturnType()->isVoidTy()) {
+                llvmBuilder.CreateRetVoid();
+            } else if (lastBlock != basicBlock && llvm::pred_empty(lastBlock)) {
+                llvmBuilder.CreateUnreachable();
+            } else {
+                logError("Function " + proto->name + " can reach its end without returning a value");
+                function->deleteBody();
+                return nullptr;
+            }
         }
 
-        function->eraseFromParent();
-        return nullptr;
+        promoteLocals(*function);
+        verifyFunction(*function);
+
+        if (proto->simd) {
+            for (auto &isa : simdCloneIsas) {
+                createSimdClone(*function, isa);
+            }
+        }
+        if (proto->batch && !createBatchFunction(*function)) {
+            logError("Function " + proto->name + "_batch already exists");
+            function->deleteBody();
+            return nullptr;
+        }
+        return function;
+    }
+
+    llvm::FastMathFlags fastMathFlags() const
+    {
+        llvm::FastMathFlags flags;
+        if (proto->fastMath) {
+            flags.setFast();
+        } else if (proto->fpContract == FpContract::fast) {
+            flags.setAllowContract(true);
+        }
+        return flags;
+    }
+
+    // The backend reads these per function, precise functions say false so -ffast-math in the target
+    // options doesn't apply to them
+    void addFloatAttributes(llvm::Function &function) const
+    {
+        if (!proto->fastMath && !proto->precise) {
+            return;
+        }
+        const char *value = proto->fastMath ? "true" : "false";
+        for (const char *name : { "unsafe-fp-math", "no-infs-fp-math", "no-nans-fp-math", "no-signed-zeros-fp-math" }) {
+            function.addFnAttr(name, value);
+        }
     }
 
     PrototypeAST *proto;
     ExprAST *body;
+    size_t tokenCount = 0; // Tokens the function was parsed from
+};
+
+// A whole source file: function definitions and extern declarations in the order they appear
+struct TranslationUnitAST : public ExprAST {
+    TranslationUnitAST()
+    {
+    }
+
+    void push(ExprAST *decl)
+    {
+        decls.push_back(decl);
+    }
+
+    virtual const char *kindName() const override
+    {
+        return "TranslationUnit";
+    }
+
+    virtual nlohmann::json toJson() override
+    {
+        nlohmann::json json;
+
+        auto &declsJson = json["decls"];
+        for (auto *decl : decls) {
+            declsJson.push_back(decl->toJson());
+        }
+
+        return json;
+    }
+
+    virtual void visitChildren(const std::function<void(ExprAST *)> &visitor) override
+    {
+        for (auto *decl : decls) {
+            visitor(decl);
+        }
+    }
+
+    virtual llvm::Value *codeGen() override
+    {
+        // Functions may be called before the point they are defined at. The first definition wins,
+        // later ones of the same name are rejected when they are generated.
+        std::set<std::string> defined;
+        for (auto *decl : decls) {
+            auto *function = dynamic_cast<FunctionAST *>(decl);
+            if (function && defined.insert(function->proto->name).second) {
+                functionProtos[function->proto->name] = function->proto;
+            }
+        }
+        for (auto *decl : decls) {
+            if (auto *proto = dynamic_cast<PrototypeAST *>(decl)) {
+                functionProtos.emplace(proto->name, proto);
+            }
+        }
+
+        llvm::Value *lastValue = nullptr;
+        bool failed = false;
+        for (auto *decl : decls) {
+            lastValue = decl->codeGen();
+            if (!lastValue) {
+                failed = true;
+            }
+        }
+        return failed ? nullptr : lastValue;
+    }
+
+    std::vector<ExprAST *> decls;
 };
 
+// -ffast-math and -ffp-contract apply to every function that isn't declared precise
+inline void applyFloatOptions(TranslationUnitAST *unit, const Options &options)
+{
+    for (auto *decl : unit->decls) {
+        auto *function = dynamic_cast<FunctionAST *>(decl);
+        if (!function || function->proto->precise) {
+            continue;
+        }
+        PrototypeAST &proto = *function->proto;
+        proto.fastMath |= options.fastMath;
+        if (proto.fastMath || options.fpContract == FpContract::fast) {
+            proto.fpContract = FpContract::fast;
+        } else if (options.fpContract == FpContract::on) {
+            proto.fpContract = FpContract::on;
+        }
+    }
+}
+
+inline void deleteAst(ExprAST *node)
+{
+    node->visitChildren([](ExprAST *child) { deleteAst(child); });
+    delete node;
+}
+
+inline uint64_t countAstNodes(ExprAST *node)
+{
+    uint64_t count = 1;
+    node->visitChildren([&](ExprAST *child) { count += countAstNodes(child); });
+    return count;
+}
+
 } // namespace cju
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "common.h"
+#include "options.hpp"
+#include "output.hpp"
+#include "timing.hpp"
+
+namespace cju
+{
+
+// Partition count for parallel code generation is derived from the module alone, so the
+// emitted archive is byte for byte the same no matter how many threads were used.
+static constexpr unsigned maxCodeGenPartitions = 32;
+
+// Safe to call for every compilation, the targets are only registered once per process
+inline void initializeTargets()
+{
+    static std::once_flag initialized;
+    std::call_once(initialized, []() {
+        llvm::InitializeAllTargetInfos();
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmParsers();
+        llvm::InitializeAllAsmPrinters();
+    });
+}
+
+inline llvm::CodeGenOpt::Level toCodeGenOptLevel(unsigned optLevel)
+{
+    switch (optLevel) {
+    case 0:
+        return llvm::CodeGenOpt::None;
+    case 1:
+        return llvm::CodeGenOpt::Less;
+    case 2:
+        return llvm::CodeGenOpt::Default;
+    default:
+        return llvm::CodeGenOpt::Aggressive;
+    }
+}
+
+inline std::unique_ptr<llvm::TargetMachine> createTargetMachine(const Options &options)
+{
+    auto targetTriple = llvm::sys::getDefaultTargetTriple();
+
+    std::string error;
+    auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
+
+    if (!target) {
+        errs() << error << std::endl;
+        return nullptr;
+    }
+
+    llvm::TargetOptions opt;
+    // Functions carry their own fp-math attributes, which take precedence over these, so precise
+    // functions stay exact. Contraction is decided by the contract flags of every operation instead
+    // of AllowFPOpFusion, which can't be turned off for a single function.
+    opt.UnsafeFPMath = options.fastMath;
+    opt.NoInfsFPMath = options.fastMath;
+    opt.NoNaNsFPMath = options.fastMath;
+    opt.NoSignedZerosFPMath = options.fastMath;
+    // Code that takes the address of a function, like the ifunc resolvers and parallel for, only links
+    // into PIE executables and shared libraries when it loads the address position independently
+    auto rm = llvm::Optional<llvm::Reloc::Model>(llvm::Reloc::PIC_);
+    auto targetMachine = target->createTargetMachine(targetTriple, options.cpu, options.features, opt, rm, llvm::None,
+                                                     toCodeGenOptLevel(options.optLevel));
+
+    return std::unique_ptr<llvm::TargetMachine>(targetMachine);
+}
+
+inline void optimizeModule(llvm::Module &module, llvm::TargetMachine &targetMachine, unsigned optLevel)
+{
+    if (optLevel == 0) {
+        return;
+    }
+
+    PhaseTimer timer("optimize", module.getName().str());
+
+    llvm::PassManagerBuilder builder;
+    builder.OptLevel = optLevel;
+    builder.Inliner = llvm::createFunctionInliningPass(optLevel, 0, false);
+    builder.LoopVectorize = optLevel > 1;
+    builder.SLPVectorize = optLevel > 1;
+    targetMachine.adjustPassManager(builder);
+
+    llvm::legacy::FunctionPassManager functionPasses(&module);
+    functionPasses.add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+    builder.populateFunctionPassManager(functionPasses);
+
+    llvm::legacy::PassManager modulePasses;
+    modulePasses.add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+    builder.populateModulePassManager(modulePasses);
+
+    functionPasses.doInitialization();
+    for (auto &function : module) {
+        functionPasses.run(function);
+    }
+    functionPasses.doFinalization();
+
+    modulePasses.run(module);
+}
+
+inline bool emitObject(llvm::Module &module, llvm::TargetMachine &targetMachine, llvm::raw_pwrite_stream &dest)
+{
+    PhaseTimer timer("emit", module.getName().str());
+
+    llvm::legacy::PassManager pass;
+    auto fileType = llvm::CodeGenFileType::CGFT_ObjectFile;
+
+    if (targetMachine.addPassesToEmitFile(pass, dest, nullptr, fileType)) {
+        errs() << "targetMachine can't emit a file of type " << fileType << std::endl;
+        return false;
+    }
+
+    pass.run(module);
+    return true;
+}
+
+inline bool emitObjectFile(llvm::Module &module, llvm::TargetMachine &targetMachine, const std::string &filename)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream dest(filename, ec, llvm::sys::fs::OF_None);
+
+    if (ec) {
+        errs() << "Could not open file: " << ec.message() << std::endl;
+        return false;
+    }
+
+    if (!emitObject(module, targetMachine, dest)) {
+        return false;
+    }
+
+    dest.flush();
+    return true;
+}
+
+// Bitcode is how modules are moved between LLVMContexts, e.g. onto other threads or into the jit
+inline llvm::SmallVector<char, 0> writeModuleBitcode(const llvm::Module &module)
+{
+    llvm::SmallVector<char, 0> bitcode;
+    llvm::raw_svector_ostream stream(bitcode);
+    llvm::WriteBitcodeToFile(module, stream);
+    return bitcode;
+}
+
+inline std::unique_ptr<llvm::Module> parseModuleBitcode(const llvm::SmallVector<char, 0> &bitcode,
+                                                        llvm::LLVMContext &context)
+{
+    llvm::StringRef contents(bitcode.data(), bitcode.size());
+    auto module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(contents, "bitcode"), context);
+    if (!module) {
+        errs() << "Failed to read bitcode: " << llvm::toString(module.takeError()) << std::endl;
+        return nullptr;
+    }
+    return std::move(*module);
+}
+
+inline unsigned countDefinedFunctions(const llvm::Module &module)
+{
+    unsigned count = 0;
+    for (auto &function : module) {
+        if (!function.isDeclaration()) {
+            count++;
+        }
+    }
+    return count;
+}
+
+inline bool writeObjectArchive(const std::string &filename, const llvm::Triple &triple,
+                               const std::vector<llvm::SmallVector<char, 0>> &objects,
+                               const std::vector<std::string> &memberNames)
+{
+    std::vector<llvm::NewArchiveMember> members;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        llvm::StringRef contents(objects[i].data(), objects[i].size());
+        members.emplace_back(llvm::MemoryBufferRef(contents, memberNames[i]));
+    }
+
+    auto kind = triple.isOSDarwin() ? llvm::object::Archive::K_DARWIN : llvm::object::Archive::K_GNU;
+    if (llvm::Error error = llvm::writeArchive(filename, members, true, kind, true, false)) {
+        errs() << "Could not write archive " << filename << ": " << llvm::toString(std::move(error)) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Splits the module into partitions and runs the backend for them on separate threads.
+// Every partition is moved into its own LLVMContext through bitcode, since a context
+// must only be used from one thread at a time. The partition objects are written
+// into a single archive that can be linked like the regular object output.
+inline bool emitObjectArchiveParallel(llvm::Module &module, const Options &options, const std::string &filename)
+{
+    unsigned partitionCount = std::max(1u, std::min(countDefinedFunctions(module), maxCodeGenPartitions));
+
+    // CloneModule leaves ifuncs out of the partitions, they are added back to the partition with their
+    // resolver. Nothing in the module calls them, so no partition depends on where they end up.
+    std::vector<std::pair<std::string, std::string>> ifuncs;
+    for (auto &ifunc : module.ifuncs()) {
+        if (auto *resolver = llvm::dyn_cast<llvm::Function>(ifunc.getResolver())) {
+            ifuncs.emplace_back(ifunc.getName().str(), resolver->getName().str());
+        }
+    }
+
+    std::vector<llvm::SmallVector<char, 0>> partitionBitcode;
+    auto addPartition = [&](std::unique_ptr<llvm::Module> partition) {
+        partitionBitcode.push_back(writeModuleBitcode(*partition));
+    };
+    // Static functions stay local, SplitModule keeps them in the partition of their callers then.
+    // Otherwise it exports them under their own name, where they clash with the statics of other files.
+#if LLVM_VERSION_MAJOR >= 11
+    llvm::SplitModule(module, partitionCount, addPartition, true);
+#else
+    llvm::SplitModule(llvm::CloneModule(module), partitionCount, addPartition, true);
+#endif
+
+    std::vector<llvm::SmallVector<char, 0>> partitionObjects(partitionBitcode.size());
+    std::atomic<size_t> nextPartition { 0 };
+    std::atomic<bool> failed { false };
+
+    auto worker = [&]() {
+        for (size_t i = nextPartition++; i < partitionBitcode.size(); i = nextPartition++) {
+            PhaseTimer timer("codeGenPartition", "part" + std::to_string(i));
+            llvm::LLVMContext context;
+            auto partition = parseModuleBitcode(partitionBitcode[i], context);
+            if (!partition) {
+                failed = true;
+                continue;
+            }
+
+            for (auto &ifunc : ifuncs) {
+                llvm::Function *resolver = partition->getFunction(ifunc.second);
+                if (resolver && !resolver->isDeclaration() && !partition->getNamedValue(ifunc.first)) {
+                    llvm::GlobalIFunc::create(resolver->getReturnType()->getPointerElementType(), 0,
+                                              llvm::GlobalValue::ExternalLinkage, ifunc.first, resolver,
+                                              partition.get());
+                }
+            }
+
+            auto targetMachine = createTargetMachine(options);
+            if (!targetMachine) {
+                failed = true;
+                continue;
+            }
+
+            llvm::raw_svector_ostream dest(partitionObjects[i]);
+            if (!emitObject(*partition, *targetMachine, dest)) {
+                failed = true;
+            }
+        }
+    };
+
+    unsigned threadCount = std::min<unsigned>(options.jobs, partitionBitcode.size());
+    bool traced = llvm::timeTraceProfilerEnabled();
+#if LLVM_VERSION_MAJOR < 11
+    // Before LLVM 11 there is one time trace profiler for the whole process, which isn't thread safe
+    if (traced) {
+        threadCount = 1;
+    }
+#endif
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; ++i) {
+        threads.emplace_back([&]() {
+            ThreadTimeTrace trace(traced);
+            worker();
+        });
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    if (failed) {
+        errs() << "Failed to generate code for a module partition" << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> memberNames;
+    for (size_t i = 0; i < partitionObjects.size(); ++i) {
+        memberNames.push_back("part" + std::to_string(i) + ".o");
+    }
+
+    return writeObjectArchive(filename, llvm::Triple(module.getTargetTriple()), partitionObjects, memberNames);
+}
+
+} // namespace cju
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "common.h"
+#include "ast.hpp"
+#include "output.hpp"
+
+namespace cju
+{
+
+// Exported functions that take and return numbers get a name_batch entry point over arrays
+inline bool canHaveBatchFunction(const PrototypeAST &proto)
+{
+    if (proto.internal || proto.args.empty() || !isScalarTypeName(proto.type)) {
+        return false;
+    }
+    for (auto &arg : proto.args) {
+        if (!isScalarTypeName(arg.type)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void enableBatchFunctions(TranslationUnitAST *unit)
+{
+    for (auto *decl : unit->decls) {
+        if (auto *function = dynamic_cast<FunctionAST *>(decl)) {
+            function->proto->batch = canHaveBatchFunction(*function->proto);
+        }
+    }
+}
+
+// Spelling of a type in C, false for the vector types C has no register type for
+inline bool cTypeName(const std::string &type, std::string &cType)
+{
+    if (!type.empty() && type.back() == '*') {
+        if (!cTypeName(type.substr(0, type.size() - 1), cType)) {
+            return false;
+        }
+        cType += " *";
+        return true;
+    }
+
+    std::string elementName;
+    unsigned lanes = 0;
+    if (splitVectorTypeName(type, elementName, lanes)) {
+        unsigned bits = lanes * (elementName == "int" || elementName == "float" ? 32 : 64);
+        if (bits != 128 && bits != 256 && bits != 512) {
+            return false;
+        }
+        cType = "__m" + std::to_string(bits) + (elementName == "float" ? "" : elementName == "double" ? "d" : "i");
+        return true;
+    }
+
+    if (type == "long") {
+        cType = "int64_t";
+    } else {
+        cType = type;
+    }
+    return true;
+}
+
+// Appends underscores until the name differs from the argument names of the function
+inline std::string uniqueParamName(std::string name, const PrototypeAST &proto)
+{
+    for (;;) {
+        bool taken = false;
+        for (auto &arg : proto.args) {
+            taken |= arg.name == name;
+        }
+        if (!taken) {
+            return name;
+        }
+        name += "_";
+    }
+}
+
+// Declarations of every exported function of the file and of the batch entry points, to be
+// included by C and C++ hosts that link the object
+inline std::string generateCHeader(TranslationUnitAST *unit, const std::string &sourceName)
+{
+    std::stringstream declarations;
+    bool usesVectors = false;
+    unsigned widestByValue = 128;
+    for (auto *decl : unit->decls) {
+        auto *function = dynamic_cast<FunctionAST *>(decl);
+        if (!function || function->proto->internal) {
+            continue;
+        }
+        PrototypeAST &proto = *function->proto;
+
+        std::string returnType;
+        bool representable = cTypeName(proto.type, returnType);
+        std::vector<std::string> argTypes;
+        for (auto &arg : proto.args) {
+            argTypes.emplace_back();
+            representable &= cTypeName(arg.type, argTypes.back());
+        }
+        if (!representable) {
+            declarations << "// " << proto.name << " has a vector type without a C equivalent\n\n";
+            continue;
+        }
+
+        std::vector<std::string> params;
+        auto addType = [&](const std::string &cType) {
+            if (cType.compare(0, 3, "__m") == 0) {
+                usesVectors = true;
+                if (cType.back() != '*') {
+                    widestByValue = std::max(widestByValue, static_cast<unsigned>(std::stoul(cType.substr(3, 3))));
+                }
+            }
+        };
+        addType(returnType);
+        for (size_t i = 0; i < argTypes.size(); ++i) {
+            addType(argTypes[i]);
+            params.push_back((proto.args[i].constant ? "const " : "") + argTypes[i] +
+                             (argTypes[i].back() == '*' ? "" : " ") + (proto.args[i].noalias ? "__restrict " : "") +
+                             proto.args[i].name);
+        }
+
+        // -fopenmp-simd defines no macro of its own, so it needs CJU_OMP_SIMD to see the simd variants
+        if (proto.simd) {
+            declarations << "#if defined(_OPENMP) || defined(CJU_OMP_SIMD)\n"
+                         << "#pragma omp declare simd notinbranch\n"
+                         << "#endif\n";
+        }
+        declarations << returnType << (returnType.back() == '*' ? "" : " ") << proto.name << "(";
+        for (size_t i = 0; i < params.size(); ++i) {
+            declarations << (i ? ", " : "") << params[i];
+        }
+        declarations << (params.empty() ? "void" : "") << ");\n";
+
+        if (proto.batch) {
+            declarations << "void " << proto.name << "_batch(";
+            for (size_t i = 0; i < proto.args.size(); ++i) {
+                declarations << "const " << argTypes[i] << " *__restrict " << proto.args[i].name << ", ";
+            }
+            declarations << returnType << " *__restrict " << uniqueParamName("out", proto) << ", size_t "
+                         << uniqueParamName("n", proto) << ");\n";
+        }
+        declarations << "\n";
+    }
+
+    std::stringstream header;
+    header << "// Generated by cju from " << sourceName << ", declares the functions of its object\n"
+           << "#ifndef CJU_OUTPUT_H\n"
+           << "#define CJU_OUTPUT_H\n\n"
+           << "#include <stddef.h>\n"
+           << "#include <stdint.h>\n";
+    if (usesVectors) {
+        header << "#include <immintrin.h>\n";
+    }
+    // Without the extension C compilers pass __m256 and __m512 in memory, cju passes them in registers
+    if (widestByValue > 128) {
+        const char *macro = widestByValue > 256 ? "__AVX512F__" : "__AVX__";
+        header << "\n#ifndef " << macro << "\n"
+               << "#error \"The functions of this header pass __m" << widestByValue << " by value, compile with "
+               << (widestByValue > 256 ? "-mavx512f" : "-mavx") << "\"\n"
+               << "#endif\n";
+    }
+    header << "\n#ifdef __cplusplus\n"
+           << "extern \"C\" {\n"
+           << "#endif\n\n"
+           << declarations.str()
+           << "#ifdef __cplusplus\n"
+           << "}\n"
+           << "#endif\n\n"
+           << "#endif // CJU_OUTPUT_H\n";
+    return header.str();
+}
+
+inline bool writeCHeader(TranslationUnitAST *unit, const std::string &sourceName, const std::string &filename)
+{
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        errs() << "Could not open header file " << filename << std::endl;
+        return false;
+    }
+    file << generateCHeader(unit, sourceName);
+    return true;
+}
+
+} // namespace cju
@@ -0,0 +1,346 @@
+#pragma once
+
+#include "common.h"
+#include "options.hpp"
+#include "output.hpp"
+
+namespace cju
+{
+
+// Identifies the build of cju in the cache keys, so that a rebuilt compiler never reuses the outputs
+// of an older one. build.sh passes the git revision, the build time tells rebuilds of a modified tree
+// apart.
+#ifndef CJU_BUILD_ID
+#define CJU_BUILD_ID unknown
+#endif
+#define CJU_STRINGIFY_VALUE(value) #value
+#define CJU_STRINGIFY(value) CJU_STRINGIFY_VALUE(value)
+static constexpr const char *cjuBuildId = CJU_STRINGIFY(CJU_BUILD_ID) " " __DATE__ " " __TIME__;
+
+// Outputs of one compilation are stored as <key><extension> in the cache directory,
+// one file per extension. Entries are evicted least recently used first, a hit
+// refreshes the modification time of the entry.
+struct CompileCache {
+    std::string dir;
+    uint64_t maxSize;
+};
+
+struct CompileCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
+
+// Hashes the compiler and target configuration together with the given fields
+inline std::string hashCacheKey(const Options &options, const std::vector<std::string> &fields)
+{
+    llvm::SHA1 hasher;
+    auto addField = [&](const std::string &field) {
+        hasher.update(std::to_string(field.size()) + ":");
+        hasher.update(field);
+    };
+
+    addField(cjuBuildId);
+    addField(LLVM_VERSION_STRING);
+    addField(llvm::sys::getDefaultTargetTriple());
+    addField(options.cpu);
+    addField(options.features);
+    addField(std::to_string(options.optLevel));
+    addField(llvm::join(options.multiversion, ","));
+    addField(std::string(options.fastMath ? "fast-math" : "") + "," + fpContractName(options.fpContract));
+    for (auto &field : fields) {
+        addField(field);
+    }
+
+    return llvm::toHex(hasher.final(), true);
+}
+
+inline std::string outputKind(const Options &options)
+{
+    std::string batch = options.batch ? "+batch" : "";
+    if (options.incremental) {
+        return "incremental" + batch;
+    }
+    return (options.jobs > 0 ? "archive" : "object") + batch;
+}
+
+// Extensions of the files a compilation writes into the output directory as output<extension>
+inline std::vector<std::string> compileOutputExtensions(const Options &options)
+{
+    bool emitsArchive = options.jobs > 0 || options.incremental;
+    std::vector<std::string> extensions = { ".json", emitsArchive ? ".a" : ".o" };
+    if (options.batch) {
+        extensions.push_back(".h");
+    }
+    return extensions;
+}
+
+inline std::string computeCacheKey(const std::string &source, const Options &options)
+{
+    return hashCacheKey(options, { outputKind(options), source });
+}
+
+inline std::string joinPath(const std::string &dir, const std::string &filename)
+{
+    llvm::SmallString<256> path(dir);
+    llvm::sys::path::append(path, filename);
+    return path.str().str();
+}
+
+inline bool readWholeFile(const std::string &path, std::string &contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    contents.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Writes to a temporary file first, so that concurrent cju processes never see partial files
+inline bool writeCacheFile(const std::string &path, const std::string &contents)
+{
+    std::string tempPath = path + ".tmp" + std::to_string(llvm::sys::Process::getProcessId());
+
+    {
+        std::ofstream file(tempPath, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        file << contents;
+    }
+
+    if (llvm::sys::fs::rename(tempPath, path)) {
+        llvm::sys::fs::remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+inline CompileCacheStats loadCacheStats(const CompileCache &cache)
+{
+    CompileCacheStats stats;
+
+    std::string contents;
+    if (!readWholeFile(joinPath(cache.dir, "stats.json"), contents)) {
+        return stats;
+    }
+
+    auto json = nlohmann::json::parse(contents, nullptr, false);
+    if (json.is_object()) {
+        stats.hits = json.value("hits", uint64_t(0));
+        stats.misses = json.value("misses", uint64_t(0));
+        stats.evictions = json.value("evictions", uint64_t(0));
+    }
+    return stats;
+}
+
+// Adds to the counters while holding stats.json.lock, so that concurrent cju processes don't lose
+// each other's counts
+inline void updateCacheStats(const CompileCache &cache, uint64_t hits, uint64_t misses, uint64_t evictions)
+{
+    std::string path = joinPath(cache.dir, "stats.json");
+    for (;;) {
+        llvm::LockFileManager lock(path);
+        switch (lock.getState()) {
+        case llvm::LockFileManager::LFS_Owned: {
+            CompileCacheStats stats = loadCacheStats(cache);
+
+            nlohmann::json json;
+            json["hits"] = stats.hits + hits;
+            json["misses"] = stats.misses + misses;
+            json["evictions"] = stats.evictions + evictions;
+
+            writeCacheFile(path, json.dump());
+            return;
+        }
+        case llvm::LockFileManager::LFS_Shared:
+            // The owner checks for dead processes itself, a timeout means it hangs
+            if (lock.waitForUnlock() == llvm::LockFileManager::Res_Timeout) {
+                lock.unsafeRemoveLockFile();
+            }
+            break;
+        case llvm::LockFileManager::LFS_Error:
+            errs() << "Could not lock " << path << ", the cache statistics are not updated" << std::endl;
+            return;
+        }
+    }
+}
+
+inline bool initializeCache(CompileCache &cache, const Options &options)
+{
+    cache.dir = options.cacheDir;
+    cache.maxSize = options.cacheMaxSize;
+
+    if (std::error_code ec = llvm::sys::fs::create_directories(cache.dir)) {
+        errs() << "Could not create cache directory " << cache.dir << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+struct CacheFile {
+    std::string path;
+    std::string key;
+    uint64_t size;
+    llvm::sys::TimePoint<> lastUse;
+};
+
+inline std::vector<CacheFile> listCacheFiles(const CompileCache &cache)
+{
+    std::vector<CacheFile> files;
+
+    std::error_code ec;
+    for (llvm::sys::fs::directory_iterator it(cache.dir, ec), end; it != end && !ec; it.increment(ec)) {
+        llvm::StringRef filename = llvm::sys::path::filename(it->path());
+        if (filename.startswith("stats.json") || filename.contains(".tmp")) {
+            continue;
+        }
+
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(it->path(), status) || status.type() != llvm::sys::fs::file_type::regular_file) {
+            continue;
+        }
+
+        files.push_back({ it->path(), llvm::sys::path::stem(filename).str(), status.getSize(),
+                          status.getLastModificationTime() });
+    }
+
+    return files;
+}
+
+inline bool readCacheEntry(const CompileCache &cache, const std::string &key, const std::string &extension,
+                           std::string &contents)
+{
+    std::string path = joinPath(cache.dir, key + extension);
+    if (!readWholeFile(path, contents)) {
+        return false;
+    }
+
+    int fd = -1;
+    if (!llvm::sys::fs::openFileForWrite(path, fd, llvm::sys::fs::CD_OpenExisting, llvm::sys::fs::OF_Append)) {
+        llvm::sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+        llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+    }
+    return true;
+}
+
+inline bool writeCacheEntry(const CompileCache &cache, const std::string &key, const std::string &extension,
+                            const std::string &contents)
+{
+    if (!writeCacheFile(joinPath(cache.dir, key + extension), contents)) {
+        errs() << "Could not store " << key << extension << " in the cache" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Copies the cached files for every extension to outputDir/output<extension>. Only counts
+// as a hit if every file is present and could be written.
+inline bool cacheLookup(const CompileCache &cache, const std::string &key,
+                        const std::vector<std::string> &extensions, const std::string &outputDir)
+{
+    std::vector<std::string> contents(extensions.size());
+    for (size_t i = 0; i < extensions.size(); ++i) {
+        if (!readCacheEntry(cache, key, extensions[i], contents[i])) {
+            updateCacheStats(cache, 0, 1, 0);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < extensions.size(); ++i) {
+        std::string path = joinPath(outputDir, "output" + extensions[i]);
+        std::ofstream file(path, std::ios::binary);
+        file << contents[i];
+        file.close();
+        if (!file) {
+            errs() << "Could not write " << path << " from the cache" << std::endl;
+            updateCacheStats(cache, 0, 1, 0);
+            return false;
+        }
+    }
+
+    updateCacheStats(cache, 1, 0, 0);
+    return true;
+}
+
+inline uint64_t evictCacheEntries(const CompileCache &cache)
+{
+    struct Entry {
+        llvm::sys::TimePoint<> lastUse;
+        uint64_t size = 0;
+        std::vector<std::string> paths;
+    };
+
+    std::map<std::string, Entry> entries;
+    uint64_t totalSize = 0;
+    for (auto &file : listCacheFiles(cache)) {
+        auto &entry = entries[file.key];
+        entry.lastUse = entry.paths.empty() ? file.lastUse : std::max(entry.lastUse, file.lastUse);
+        entry.size += file.size;
+        entry.paths.push_back(file.path);
+        totalSize += file.size;
+    }
+
+    std::vector<Entry *> leastRecentlyUsed;
+    for (auto &entry : entries) {
+        leastRecentlyUsed.push_back(&entry.second);
+    }
+    std::sort(leastRecentlyUsed.begin(), leastRecentlyUsed.end(),
+              [](const Entry *a, const Entry *b) { return a->lastUse < b->lastUse; });
+
+    uint64_t evictions = 0;
+    for (auto *entry : leastRecentlyUsed) {
+        if (totalSize <= cache.maxSize) {
+            break;
+        }
+        for (auto &path : entry->paths) {
+            llvm::sys::fs::remove(path);
+        }
+        totalSize -= entry->size;
+        evictions++;
+    }
+
+    return evictions;
+}
+
+// Stores outputDir/output<extension> for every extension under the key
+inline void cacheStore(const CompileCache &cache, const std::string &key,
+                       const std::vector<std::string> &extensions, const std::string &outputDir)
+{
+    for (auto &extension : extensions) {
+        std::string contents;
+        if (!readWholeFile(joinPath(outputDir, "output" + extension), contents) ||
+            !writeCacheEntry(cache, key, extension, contents)) {
+            return;
+        }
+    }
+
+    uint64_t evictions = evictCacheEntries(cache);
+    if (evictions > 0) {
+        updateCacheStats(cache, 0, 0, evictions);
+    }
+}
+
+inline void printCacheStats(const CompileCache &cache)
+{
+    CompileCacheStats stats = loadCacheStats(cache);
+
+    std::set<std::string> keys;
+    uint64_t totalSize = 0;
+    for (auto &file : listCacheFiles(cache)) {
+        keys.insert(file.key);
+        totalSize += file.size;
+    }
+
+    uint64_t lookups = stats.hits + stats.misses;
+    outs() << "Cache directory: " << cache.dir << "\n"
+              << "Entries:         " << keys.size() << "\n"
+              << "Size:            " << totalSize << " / " << cache.maxSize << " bytes\n"
+              << "Hits:            " << stats.hits << "\n"
+              << "Misses:          " << stats.misses << "\n"
+              << "Hit rate:        " << (lookups ? 100.0 * stats.hits / lookups : 0.0) << "%\n"
+              << "Evictions:       " << stats.evictions << std::endl;
+}
+
+} // namespace cju
@@ -3,11 +3,20 @@
 #define LEXER_IMPLEMENTATION
 #include "lexer.h"
 
-// NOTE: Right now our strategy is to leak all the memory allocated when generating our AST
-// It's just not worth iterating through the tree to deallocate everything, when the system
-// will release all our resources anyway. If there will ever be a memory pool for the AST,
-// then maybe we can release that pool when we're done with it.
+// NOTE: The AST of a whole file is released by compile() once it's done with it, so that a
+// long running server doesn't keep them around. Everything else, e.g. partial trees of a
+// failed parse or the chunks of the repl, is still leaked, the system releases it on exit.
 #include "ast.hpp"
+#include "backend.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "incremental.hpp"
+#include "jit.hpp"
+#include "multiversion.hpp"
+#include "output.hpp"
+#include "options.hpp"
+#include "server.hpp"
+#include "stats.hpp"
 
 namespace cju
 {
@@ -42,7 +51,7 @@ inline void lexerLogCallback(void*, enum lexer_log_level logLevel, lexer_size li
     errorOutput << "on line ";
     errorOutput << line;
     errorOutput << msg;
-    std::cerr << errorOutput.str() << std::endl;
+    errs() << errorOutput.str() << std::endl;
 }
 
 inline bool tokenizeFile(const std::string &fileContents, std::vector<lexer_token> &tokens)
@@ -54,6 +63,10 @@ inline bool tokenizeFile(const std::string &fileContents, std::vector<lexer_toke
 
     lexer_token tok;
     while(lexer_expect_any(&lexer, &tok)) {
+        // Number values are parsed lazily by the lexer, resolve them while the token is still mutable
+        if (tok.type == LEXER_TOKEN_NUMBER) {
+            lexer_token_to_double(&tok);
+        }
         tokens.push_back(tok);
     }
 
@@ -80,12 +93,14 @@ inline std::string toString(const lexer_token &token)
     return result;
 }
 
-inline void logUnexpectedTokenAndExit(const lexer_token &token)
+// Parser functions log the error and return nullptr on unexpected input instead of exiting,
+// so that a bad input doesn't take down a long running process like the repl or the server
+inline bool logUnexpectedToken(const lexer_token &token)
 {
-    std::cerr << "Unexpected token \"" << toString(token)
+    errs() << "Unexpected token \"" << toString(token)
               << "\" on line: " << token.line
               << std::endl;
-    exit(EXIT_FAILURE);
+    return false;
 }
 
 inline bool tokenTypeEq(const lexer_token &token, lexer_token_type tokenType)
@@ -94,11 +109,16 @@ inline bool tokenTypeEq(const lexer_token &token, lexer_token_type tokenType)
     return result;
 }
 
-inline void expectTokenTypeEq(const lexer_token &token, lexer_token_type tokenType)
+// The expect functions take nullptr for the end of the input, which tokenAt has logged already
+inline bool expectTokenTypeEq(const lexer_token *token, lexer_token_type tokenType)
 {
-    if (!tokenTypeEq(token, tokenType)) {
-        logUnexpectedTokenAndExit(token);
+    if (!token) {
+        return false;
     }
+    if (!tokenTypeEq(*token, tokenType)) {
+        return logUnexpectedToken(*token);
+    }
+    return true;
 }
 
 inline bool tokenEq(const lexer_token &token, const std::string &str)
@@ -108,49 +128,165 @@ inline bool tokenEq(const lexer_token &token, const std::string &str)
     return result;
 }
 
-inline void expectTokenEq(const lexer_token &token, const std::string &str)
+inline bool expectTokenEq(const lexer_token *token, lexer_token_type tokenType, const std::string &str)
 {
-    if (!tokenEq(token, str)) {
-        logUnexpectedTokenAndExit(token);
+    if (!expectTokenTypeEq(token, tokenType)) {
+        return false;
+    }
+    if (!tokenEq(*token, str)) {
+        return logUnexpectedToken(*token);
     }
+    return true;
 }
 
 inline bool tokenIsAType(const lexer_token &token)
 {
     bool isName = tokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME);
-    bool typeNameMatches = tokenEq(token, "int") || tokenEq(token, "float");
+    bool typeNameMatches = isTypeName(toString(token));
     bool result = isName && typeNameMatches;
     return result;
 }
 
-inline void expectTokenIsAType(const lexer_token &token)
+inline bool expectTokenIsAType(const lexer_token *token)
+{
+    if (!token) {
+        return false;
+    }
+    if (!tokenIsAType(*token)) {
+        return logUnexpectedToken(*token);
+    }
+    return true;
+}
+
+inline const lexer_token *peekToken(const std::vector<lexer_token> &tokens, int index)
+{
+    if (index < 0 || index >= static_cast<int>(tokens.size())) {
+        return nullptr;
+    }
+    return &tokens[index];
+}
+
+// Like peekToken, but logs an error at the end of the input
+inline const lexer_token *tokenAt(const std::vector<lexer_token> &tokens, int index)
+{
+    auto *token = peekToken(tokens, index);
+    if (!token) {
+        errs() << "Unexpected end of input after line: " << (tokens.empty() ? 0 : tokens.back().line)
+                  << std::endl;
+    }
+    return token;
+}
+
+inline const lexer_token *nextToken(const std::vector<lexer_token> &tokens, int &index)
+{
+    return tokenAt(tokens, ++index);
+}
+
+inline bool tokenIsPunctuation(const lexer_token *token, const std::string &str)
+{
+    return token && tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*token, str);
+}
+
+inline bool tokenIsKeyword(const lexer_token *token, const std::string &str)
+{
+    return token && tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME) && tokenEq(*token, str);
+}
+
+// Type with an optional const in front and a * for every level of pointers, e.g. const float*.
+// const is accepted for C compatibility, but not enforced. Leaves the index on the last token of the type.
+inline bool buildTypeName(const std::vector<lexer_token> &tokens, int &index, std::string &type, bool *isConst = nullptr)
 {
-    if (!tokenIsAType(token)) {
-        logUnexpectedTokenAndExit(token);
+    auto *token = tokenAt(tokens, index);
+    if (tokenIsKeyword(token, "const")) {
+        token = nextToken(tokens, index);
+        if (isConst) {
+            *isConst = true;
+        }
+    }
+    if (!expectTokenIsAType(token)) {
+        return false;
+    }
+    type = toString(*token);
+
+    while (tokenIsPunctuation(peekToken(tokens, index + 1), "*")) {
+        ++index;
+        type += "*";
+    }
+    return true;
+}
+
+inline bool tokenStartsAType(const lexer_token *token)
+{
+    return token && (tokenIsAType(*token) || tokenIsKeyword(token, "const"));
+}
+
+// Qualifiers after the * of a pointer parameter: restrict and align(N)
+inline bool buildPointerQualifiers(const std::vector<lexer_token> &tokens, int &index, PrototypeAST::Argument &arg)
+{
+    for (;;) {
+        auto *token = peekToken(tokens, index + 1);
+        if (tokenIsKeyword(token, "restrict")) {
+            arg.noalias = true;
+            ++index;
+        } else if (tokenIsKeyword(token, "align")) {
+            ++index;
+            if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "(")) {
+                return false;
+            }
+            token = nextToken(tokens, index);
+            if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NUMBER)) {
+                return false;
+            }
+            uint64_t alignment = token->value.i;
+            if ((token->subtype & LEXER_TOKEN_FLOAT) || alignment == 0 || (alignment & (alignment - 1)) ||
+                alignment > (1u << 29)) {
+                errs() << "Alignment must be a power of two on line: " << token->line << std::endl;
+                return false;
+            }
+            arg.alignment = static_cast<unsigned>(alignment);
+            if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+                return false;
+            }
+        } else {
+            break;
+        }
+
+        if (arg.type.back() != '*') {
+            errs() << "restrict and align only apply to pointers, on line: " << token->line << std::endl;
+            return false;
+        }
     }
+    return true;
 }
 
 inline PrototypeAST *buildPrototypeAST(const std::vector<lexer_token> &tokens, int &index)
 {
     // Type
-    auto *token = &tokens[index];
-    expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-    std::string type = toString(*token);
+    std::string type;
+    if (!buildTypeName(tokens, index, type)) {
+        return nullptr;
+    }
 
     // Name
-    token = &tokens[++index];
-    expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
+    auto *token = nextToken(tokens, index);
+    if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME)) {
+        return nullptr;
+    }
     std::string name = toString(*token);
 
     // Open paren
-    token = &tokens[++index];
-    expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-    expectTokenEq(*token, "(");
+    token = nextToken(tokens, index);
+    if (!expectTokenEq(token, lexer_token_type::LEXER_TOKEN_PUNCTUATION, "(")) {
+        return nullptr;
+    }
 
     std::vector<PrototypeAST::Argument> arguments;
     for (;;) {
-        token = &tokens[++index];
-        if (token->type == lexer_token_type::LEXER_TOKEN_PUNCTUATION && token->str[0] == ')') {
+        token = nextToken(tokens, index);
+        if (!token) {
+            return nullptr;
+        }
+        if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*token, ")")) {
             ++index;
             break;
         }
@@ -158,21 +294,31 @@ inline PrototypeAST *buildPrototypeAST(const std::vector<lexer_token> &tokens, i
         PrototypeAST::Argument arg;
 
         // Param
-        expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-        if (tokenIsAType(*token)) {
-            arg.type = toString(*token);
-        } else {
-            logUnexpectedTokenAndExit(*token);
+        if (!buildTypeName(tokens, index, arg.type, &arg.constant) || !buildPointerQualifiers(tokens, index, arg)) {
+            return nullptr;
         }
 
-        token = &tokens[++index];
-        expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
+        token = nextToken(tokens, index);
+        if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME)) {
+            return nullptr;
+        }
         arg.name = toString(*token);
 
+        // Array params are pointers like in C, type name[]
+        if (tokenIsPunctuation(peekToken(tokens, index + 1), "[")) {
+            ++index;
+            if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "]")) {
+                return nullptr;
+            }
+            arg.type += "*";
+        }
+
         arguments.push_back(arg);
 
-        token = &tokens[index + 1];
-        expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
+        token = tokenAt(tokens, index + 1);
+        if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_PUNCTUATION)) {
+            return nullptr;
+        }
         if (tokenEq(*token, ",")) {
             ++index;
         }
@@ -182,136 +328,622 @@ inline PrototypeAST *buildPrototypeAST(const std::vector<lexer_token> &tokens, i
     return proto;
 }
 
-inline FunctionAST *buildFunctionAST(const std::vector<lexer_token> &tokens, int &index)
+inline ExprAST *buildExpressionAST(const std::vector<lexer_token> &tokens, int &index);
+
+// The lexer's own conversion of floating point numbers isn't exact, so they are parsed again with strtod
+inline NumberAST *buildNumberAST(const lexer_token &token)
 {
-    PrototypeAST *proto = buildPrototypeAST(tokens, index);
+    if (token.subtype & LEXER_TOKEN_FLOAT) {
+        double value = std::strtod(std::string(token.str, token.len).c_str(), nullptr);
+        return new NumberAST(value, (token.subtype & LEXER_TOKEN_SINGLE_PREC) != 0);
+    }
+    return new NumberAST(static_cast<int64_t>(token.value.i));
+}
+
+inline bool isAssignmentOp(const std::string &op)
+{
+    return op == "=" || op == "+=" || op == "-=" || op == "*=" || op == "/=" || op == "%=";
+}
 
-    auto *token = &tokens[index];
-    expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-    expectTokenEq(*token, "{");
+inline ExprAST *buildStatementAST(const std::vector<lexer_token> &tokens, int &index);
+
+// Declaration, assignment, increment or plain expression without the semicolon, as used on
+// their own and in the head of a for loop. Leaves the index on the last token of it.
+inline ExprAST *buildSimpleStatementAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    auto *token = tokenAt(tokens, index);
+    if (!token) {
+        return nullptr;
+    }
+
+    if (tokenStartsAType(token)) {
+        std::string type;
+        if (!buildTypeName(tokens, index, type)) {
+            return nullptr;
+        }
+        token = nextToken(tokens, index);
+        if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME)) {
+            return nullptr;
+        }
+        auto *variable = new VariableAST(toString(*token), type);
+
+        // Variables declared without a value start at zero
+        if (tokenIsPunctuation(peekToken(tokens, index + 1), ";")) {
+            return new BinaryOpAST("=", variable, new NumberAST(int64_t(0)));
+        }
+
+        token = nextToken(tokens, index);
+        if (!expectTokenEq(token, lexer_token_type::LEXER_TOKEN_PUNCTUATION, "=")) {
+            return nullptr;
+        }
+
+        ExprAST *rvalue = buildExpressionAST(tokens, ++index);
+        if (!rvalue) {
+            return nullptr;
+        }
+
+        return new BinaryOpAST("=", variable, rvalue);
+    }
+
+    ExprAST *expr = buildExpressionAST(tokens, index);
+    if (!expr) {
+        return nullptr;
+    }
+
+    // i++ and i-- are statements of their own, they are not allowed within expressions
+    token = peekToken(tokens, index + 1);
+    if (tokenIsPunctuation(token, "++") || tokenIsPunctuation(token, "--")) {
+        ++index;
+        return new BinaryOpAST(tokenEq(*token, "++") ? "+=" : "-=", expr, new NumberAST(int64_t(1)));
+    }
+
+    if (token && tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && isAssignmentOp(toString(*token))) {
+        std::string op = toString(*token);
+        index += 2;
+        ExprAST *value = buildExpressionAST(tokens, index);
+        if (!value) {
+            return nullptr;
+        }
+        return new BinaryOpAST(op, expr, value);
+    }
+
+    return expr;
+}
+
+// { statements }, leaves the index on the closing brace
+inline BlockAST *buildBlockAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    if (!expectTokenEq(tokenAt(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "{")) {
+        return nullptr;
+    }
 
     BlockAST *block = new BlockAST();
     for (;;) {
-        token = &tokens[++index];
-        if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*token, ";")) {
-            auto *nextToken = &tokens[index + 1];
-            if (tokenTypeEq(*nextToken, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*nextToken, "}")) {
-                ++index;
-                break;
-            } else {
-                continue;
-            }
+        auto *token = nextToken(tokens, index);
+        if (!token) {
+            return nullptr;
+        }
+        if (tokenIsPunctuation(token, "}")) {
+            return block;
         }
 
-        if (tokenIsAType(*token)) {
-            std::string type = toString(*token);
-            token = &tokens[++index];
-            expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-            auto *variable = new VariableAST(toString(*token), type);
+        ExprAST *statement = buildStatementAST(tokens, index);
+        if (!statement) {
+            return nullptr;
+        }
+        block->push(statement);
+    }
+}
 
-            token = &tokens[++index];
-            expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-            expectTokenEq(*token, "=");
+// Parenthesized condition of if and while, the index starts on the keyword and is left on the closing paren
+inline ExprAST *buildConditionAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "(")) {
+        return nullptr;
+    }
+    ExprAST *cond = buildExpressionAST(tokens, ++index);
+    if (!cond || !expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+        return nullptr;
+    }
+    return cond;
+}
 
-            token = &tokens[++index];
-            ExprAST *lhs = nullptr;
-            if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NUMBER)) {
-                lhs = new NumberAST(token->value.f);
-            } else {
-                expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-                lhs = new VariableAST(toString(*token), "");
-            }
+inline ForAST *buildForAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "(")) {
+        return nullptr;
+    }
+
+    ExprAST *init = nullptr;
+    if (!tokenIsPunctuation(peekToken(tokens, index + 1), ";")) {
+        init = buildSimpleStatementAST(tokens, ++index);
+        if (!init) {
+            return nullptr;
+        }
+    }
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ";")) {
+        return nullptr;
+    }
+
+    ExprAST *cond = nullptr;
+    if (!tokenIsPunctuation(peekToken(tokens, index + 1), ";")) {
+        cond = buildExpressionAST(tokens, ++index);
+        if (!cond) {
+            return nullptr;
+        }
+    }
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ";")) {
+        return nullptr;
+    }
+
+    ExprAST *step = nullptr;
+    if (!tokenIsPunctuation(peekToken(tokens, index + 1), ")")) {
+        step = buildSimpleStatementAST(tokens, ++index);
+        if (!step) {
+            return nullptr;
+        }
+    }
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+        return nullptr;
+    }
+
+    ExprAST *body = buildStatementAST(tokens, ++index);
+    if (!body) {
+        return nullptr;
+    }
+
+    return new ForAST(init, cond, step, body);
+}
+
+// #pragma followed by loop hints on the same line, e.g. #pragma unroll(4) interleave(2). Leaves the
+// index on the last token of the line.
+inline bool buildLoopHints(const std::vector<lexer_token> &tokens, int &index, LoopHints &hints)
+{
+    auto line = tokens[index].line;
+    auto *token = nextToken(tokens, index);
+    if (!tokenIsKeyword(token, "pragma") || token->line != line) {
+        errs() << "Expected pragma after # on line: " << line << std::endl;
+        return false;
+    }
+
+    for (token = peekToken(tokens, index + 1); token && token->line == line; token = peekToken(tokens, index + 1)) {
+        token = nextToken(tokens, index);
+        if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME)) {
+            return false;
+        }
+        std::string name = toString(*token);
 
-            token = &tokens[++index];
-            expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-            std::string op = toString(*token);
-
-            token = &tokens[++index];
-            ExprAST *rhs = nullptr;
-            if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NUMBER)) {
-                rhs = new NumberAST(token->value.f);
-            } else {
-                expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-                rhs = new VariableAST(toString(*token), "");
+        // The argument is a positive integer literal, 0 stands for none
+        unsigned value = 0;
+        if (tokenIsPunctuation(peekToken(tokens, index + 1), "(")) {
+            ++index;
+            token = nextToken(tokens, index);
+            if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NUMBER)) {
+                return false;
             }
+            if ((token->subtype & LEXER_TOKEN_FLOAT) || token->value.i == 0 || token->value.i > 1024) {
+                errs() << "The argument of " << name << " must be an integer from 1 to 1024, on line: " << line
+                       << std::endl;
+                return false;
+            }
+            value = static_cast<unsigned>(token->value.i);
+            if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+                return false;
+            }
+        }
 
-            BinaryOpAST *rvalue;
-            if (op == "+") {
-                rvalue = new BinaryOpAST("+", lhs, rhs);
-            } else {
-                std::cerr << "Unexpected op " << op << std::endl;
-                exit(EXIT_FAILURE);
+        if (name == "unroll") {
+            hints.unroll = true;
+            hints.unrollCount = value;
+        } else if (name == "vectorize") {
+            // The vectorizer ignores widths it has no vectors for
+            if (value & (value - 1) || value > 64) {
+                errs() << "The width of vectorize must be a power of two up to 64, on line: " << line << std::endl;
+                return false;
             }
+            hints.vectorize = true;
+            hints.vectorizeWidth = value;
+        } else if (name == "interleave" && value) {
+            hints.interleaveCount = value;
+        } else if (name == "distribute" && !value) {
+            hints.distribute = true;
+        } else {
+            errs() << "Unknown loop hint " << name << " on line: " << line
+                   << ", expected unroll, unroll(N), vectorize, vectorize(width), interleave(N) or distribute"
+                   << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-            auto *bop = new BinaryOpAST("=", variable, rvalue);
-            block->push(bop);
+// Leaves the index on the last token of the statement, its semicolon or closing brace
+inline ExprAST *buildStatementAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    auto *token = tokenAt(tokens, index);
+    if (!token) {
+        return nullptr;
+    }
+
+    // Loop hints apply to the loop right after them
+    if (tokenIsPunctuation(token, "#")) {
+        LoopHints hints;
+        for (; tokenIsPunctuation(token, "#"); token = nextToken(tokens, index)) {
+            if (!buildLoopHints(tokens, index, hints)) {
+                return nullptr;
+            }
+        }
+        if (!token) {
+            return nullptr;
+        }
+        auto line = token->line;
+        ExprAST *statement = buildStatementAST(tokens, index);
+        if (!statement) {
+            return nullptr;
+        }
+        if (auto *forLoop = dynamic_cast<ForAST *>(statement)) {
+            forLoop->hints = hints;
+        } else if (auto *whileLoop = dynamic_cast<WhileAST *>(statement)) {
+            whileLoop->hints = hints;
+        } else {
+            errs() << "Loop hints must be followed by a for or while loop, on line: " << line << std::endl;
+            return nullptr;
+        }
+        return statement;
+    }
 
-            auto *nextToken = &tokens[index + 1];
-            expectTokenTypeEq(*nextToken, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-            expectTokenEq(*nextToken, ";");
+    if (tokenIsPunctuation(token, "{")) {
+        return buildBlockAST(tokens, index);
+    }
 
-            continue;
+    if (tokenIsKeyword(token, "if")) {
+        ExprAST *cond = buildConditionAST(tokens, index);
+        if (!cond) {
+            return nullptr;
         }
+        ExprAST *thenBody = buildStatementAST(tokens, ++index);
+        if (!thenBody) {
+            return nullptr;
+        }
+        ExprAST *elseBody = nullptr;
+        if (tokenIsKeyword(peekToken(tokens, index + 1), "else")) {
+            index += 2;
+            elseBody = buildStatementAST(tokens, index);
+            if (!elseBody) {
+                return nullptr;
+            }
+        }
+        return new IfAST(cond, thenBody, elseBody);
+    }
 
-        if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME) && tokenEq(*token, "return")) {
-            // token = &tokens[++index];
-            // expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-            // std::string lhs = toString(*token);
+    if (tokenIsKeyword(token, "while")) {
+        ExprAST *cond = buildConditionAST(tokens, index);
+        if (!cond) {
+            return nullptr;
+        }
+        ExprAST *body = buildStatementAST(tokens, ++index);
+        if (!body) {
+            return nullptr;
+        }
+        return new WhileAST(cond, body);
+    }
 
-            // token = &tokens[++index];
-            // expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION);
-            // std::string op = toString(*token);
-        
-            // token = &tokens[++index];
-            // expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-            // std::string rhs = toString(*token);
+    if (tokenIsKeyword(token, "for")) {
+        return buildForAST(tokens, index);
+    }
 
-            token = &tokens[++index];
-            expectTokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NAME);
-            std::string var = toString(*token);
+    if (tokenIsKeyword(token, "parallel") && tokenIsKeyword(peekToken(tokens, index + 1), "for")) {
+        ForAST *loop = buildForAST(tokens, ++index);
+        if (loop) {
+            loop->parallel = true;
+        }
+        return loop;
+    }
 
-            block->push(new StatementAST("return", new VariableAST(var, "")));
-            continue;
+    ExprAST *statement = nullptr;
+    if (tokenIsKeyword(token, "return")) {
+        // return; of void functions has no value
+        ExprAST *value = nullptr;
+        if (!tokenIsPunctuation(peekToken(tokens, index + 1), ";")) {
+            value = buildExpressionAST(tokens, ++index);
+            if (!value) {
+                return nullptr;
+            }
+        }
+        statement = new StatementAST("return", value);
+    } else {
+        statement = buildSimpleStatementAST(tokens, index);
+        if (!statement) {
+            return nullptr;
         }
     }
 
+    if (!expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ";")) {
+        return nullptr;
+    }
+    return statement;
+}
+
+inline FunctionAST *buildFunctionAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    PrototypeAST *proto = buildPrototypeAST(tokens, index);
+    if (!proto) {
+        return nullptr;
+    }
+
+    BlockAST *block = buildBlockAST(tokens, index);
+    if (!block) {
+        return nullptr;
+    }
+
     FunctionAST *func = new FunctionAST(proto, block);
     return func;
 }
 
-inline ExprAST *buildAST(const std::vector<lexer_token> &tokens)
+inline int binaryOpPrecedence(const std::string &op)
 {
-    if (tokens.size() == 0) {
-        std::cerr << "Cannot build ast, found no tokens" << std::endl;
+    if (op == "*" || op == "/" || op == "%") {
+        return 20;
+    }
+    if (op == "+" || op == "-") {
+        return 10;
+    }
+    if (op == "<" || op == "<=" || op == ">" || op == ">=") {
+        return 8;
+    }
+    if (op == "==" || op == "!=") {
+        return 7;
+    }
+    if (op == "&&") {
+        return 5;
+    }
+    if (op == "||") {
+        return 4;
+    }
+    return -1;
+}
+
+// Any number of [index] after a pointer, leaves the index on the last closing bracket
+inline ExprAST *buildIndexAST(const std::vector<lexer_token> &tokens, int &index, ExprAST *base)
+{
+    while (tokenIsPunctuation(peekToken(tokens, index + 1), "[")) {
+        index += 2;
+        ExprAST *offset = buildExpressionAST(tokens, index);
+        if (!offset || !expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, "]")) {
+            return nullptr;
+        }
+        base = new IndexAST(base, offset);
+    }
+    return base;
+}
+
+// Number, variable, parenthesized expression, cast, call, indexing or one of those negated
+inline ExprAST *buildPrimaryAST(const std::vector<lexer_token> &tokens, int &index)
+{
+    auto *token = tokenAt(tokens, index);
+    if (!token) {
         return nullptr;
     }
 
-    int it = 0;
-    FunctionAST *ast = buildFunctionAST(tokens, it);
+    if (tokenIsPunctuation(token, "-") || tokenIsPunctuation(token, "!")) {
+        std::string op = toString(*token);
+        ExprAST *operand = buildPrimaryAST(tokens, ++index);
+        if (!operand) {
+            return nullptr;
+        }
+        // Negative literals stay literals, so that they still take the type of the other operand
+        auto *number = dynamic_cast<NumberAST *>(operand);
+        if (number && op == "-") {
+            number->intValue = -number->intValue;
+            number->floatValue = -number->floatValue;
+            if (number->isInteger()) {
+                number->type = number->intValue >= INT32_MIN ? "int" : "long";
+            }
+            return number;
+        }
+        return new UnaryOpAST(op, operand);
+    }
+
+    if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_NUMBER)) {
+        return buildNumberAST(*token);
+    }
 
-    return ast;
+    auto *followingToken = peekToken(tokens, index + 1);
+    // (float4)x is a cast, (float4(a, b, c, d)) a parenthesized vector
+    if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*token, "(") &&
+        tokenStartsAType(followingToken) && !tokenIsPunctuation(peekToken(tokens, index + 2), "(")) {
+        std::string type;
+        if (!buildTypeName(tokens, ++index, type) ||
+            !expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+            return nullptr;
+        }
+        ExprAST *expr = buildPrimaryAST(tokens, ++index);
+        if (!expr) {
+            return nullptr;
+        }
+        return new CastAST(type, expr);
+    }
+
+    if (tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION) && tokenEq(*token, "(")) {
+        ExprAST *expr = buildExpressionAST(tokens, ++index);
+        if (!expr || !expectTokenEq(nextToken(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ")")) {
+            return nullptr;
+        }
+        return buildIndexAST(tokens, index, expr);
+    }
+
+    if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_NAME)) {
+        return nullptr;
+    }
+    std::string name = toString(*token);
+
+    if (!followingToken || !tokenEq(*followingToken, "(")) {
+        return buildIndexAST(tokens, index, new VariableAST(name, ""));
+    }
+
+    ++index;
+    std::vector<ExprAST *> args;
+    for (;;) {
+        token = tokenAt(tokens, ++index);
+        if (!token) {
+            return nullptr;
+        }
+        if (args.empty() && tokenEq(*token, ")")) {
+            break;
+        }
+
+        ExprAST *arg = buildExpressionAST(tokens, index);
+        if (!arg) {
+            return nullptr;
+        }
+        args.push_back(arg);
+
+        token = tokenAt(tokens, ++index);
+        if (!expectTokenTypeEq(token, lexer_token_type::LEXER_TOKEN_PUNCTUATION)) {
+            return nullptr;
+        }
+        if (tokenEq(*token, ")")) {
+            break;
+        }
+        if (!expectTokenEq(token, lexer_token_type::LEXER_TOKEN_PUNCTUATION, ",")) {
+            return nullptr;
+        }
+    }
+
+    return buildIndexAST(tokens, index, new CallAST(name, args));
 }
 
-inline void printUsage(const char* programName)
+// Binary expression with the usual precedence, leaves the index on the last token of the expression
+inline ExprAST *buildExpressionAST(const std::vector<lexer_token> &tokens, int &index)
 {
-    std::cout << "Usage: " << programName << "[file]" << std::endl;
+    ExprAST *first = buildPrimaryAST(tokens, index);
+    if (!first) {
+        return nullptr;
+    }
+
+    std::vector<ExprAST *> operands { first };
+    std::vector<std::string> ops;
+
+    auto reduce = [&]() {
+        ExprAST *rhs = operands.back();
+        operands.pop_back();
+        ExprAST *lhs = operands.back();
+        operands.back() = new BinaryOpAST(ops.back(), lhs, rhs);
+        ops.pop_back();
+    };
+
+    for (;;) {
+        auto *token = peekToken(tokens, index + 1);
+        if (!token || !tokenTypeEq(*token, lexer_token_type::LEXER_TOKEN_PUNCTUATION)) {
+            break;
+        }
+
+        std::string op = toString(*token);
+        int precedence = binaryOpPrecedence(op);
+        if (precedence < 0) {
+            break;
+        }
+
+        while (!ops.empty() && precedence <= binaryOpPrecedence(ops.back())) {
+            reduce();
+        }
+
+        ops.push_back(op);
+        index += 2;
+        ExprAST *operand = buildPrimaryAST(tokens, index);
+        if (!operand) {
+            return nullptr;
+        }
+        operands.push_back(operand);
+    }
+
+    while (!ops.empty()) {
+        reduce();
+    }
+
+    return operands.back();
 }
 
-inline int run(int argc, char **argv)
+inline PrototypeAST *buildExternAST(const std::vector<lexer_token> &tokens, int &index)
 {
-    if (argc != 2) {
-        std::cerr << "ERROR: Wrong number or arguments" << std::endl;
-        printUsage(argv[0]);
-        return EXIT_FAILURE;
+    if (!expectTokenEq(tokenAt(tokens, index), lexer_token_type::LEXER_TOKEN_NAME, "extern")) {
+        return nullptr;
     }
 
-    std::ifstream file(argv[1]);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file " << argv[1];
-        return EXIT_FAILURE;
+    PrototypeAST *proto = buildPrototypeAST(tokens, ++index);
+    if (!proto || !expectTokenEq(tokenAt(tokens, index), lexer_token_type::LEXER_TOKEN_PUNCTUATION, ";")) {
+        return nullptr;
     }
 
-    std::string fileContents;
+    return proto;
+}
+
+// Words in front of a function definition, in any order
+inline bool isFunctionSpecifier(const std::string &word)
+{
+    return word == "static" || word == "simd" || word == "fastmath" || word == "precise";
+}
+
+inline ExprAST *buildAST(const std::vector<lexer_token> &tokens)
+{
+    if (tokens.size() == 0) {
+        errs() << "Cannot build ast, found no tokens" << std::endl;
+        return nullptr;
+    }
+
+    auto *unit = new TranslationUnitAST();
+    int tokenCount = static_cast<int>(tokens.size());
+    for (int it = 0; it < tokenCount; ++it) {
+        // Both builders leave the index on the last token they consumed
+        if (tokenEq(tokens[it], "extern")) {
+            PrototypeAST *proto = buildExternAST(tokens, it);
+            if (!proto) {
+                return nullptr;
+            }
+            unit->push(proto);
+        } else {
+            int firstToken = it;
+            bool internal = false;
+            bool simd = false;
+            bool fastMath = false;
+            bool precise = false;
+            while (it < tokenCount && isFunctionSpecifier(toString(tokens[it]))) {
+                internal |= tokenEq(tokens[it], "static");
+                simd |= tokenEq(tokens[it], "simd");
+                fastMath |= tokenEq(tokens[it], "fastmath");
+                precise |= tokenEq(tokens[it], "precise");
+                ++it;
+            }
+            if (fastMath && precise) {
+                errs() << "A function can't be both fastmath and precise, on line: " << tokens[firstToken].line << std::endl;
+                return nullptr;
+            }
+            FunctionAST *function = buildFunctionAST(tokens, it);
+            if (!function) {
+                return nullptr;
+            }
+            function->proto->internal = internal;
+            function->proto->simd = simd;
+            function->proto->fastMath = fastMath;
+            function->proto->precise = precise;
+            if (fastMath) {
+                function->proto->fpContract = FpContract::fast;
+            }
+            function->tokenCount = static_cast<size_t>(it - firstToken + 1);
+            unit->push(function);
+        }
+    }
+
+    return unit;
+}
+
+inline bool readSourceFile(const std::string &path, std::string &fileContents)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        errs() << "Failed to open file " << path << std::endl;
+        return false;
+    }
 
     file.seekg(0, std::ios::end);
     fileContents.reserve(file.tellg());
@@ -320,7 +952,11 @@ inline int run(int argc, char **argv)
     fileContents.assign((std::istreambuf_iterator<char>(file)),
                        std::istreambuf_iterator<char>());
 
-    // Lexer doesn't like trailing new lines, so let's remove those before lexing    
+    return true;
+}
+
+inline void removeTrailingNewLines(std::string &fileContents)
+{
     int trailingNewLineCount = 0;
     for (auto it = fileContents.rbegin(); it != fileContents.rend(); ++it) {
         if (*it == '\n' || *it == '\r') {
@@ -330,93 +966,603 @@ inline int run(int argc, char **argv)
         }
     }
     fileContents.resize(fileContents.size() - trailingNewLineCount);
+}
+
+// Lexes and parses a whole source buffer, sourceName is only used for error messages
+inline ExprAST *buildASTFromSource(std::string fileContents, const std::string &sourceName,
+                                   size_t *tokenCount = nullptr)
+{
+    // Lexer doesn't like trailing new lines, so let's remove those before lexing    
+    removeTrailingNewLines(fileContents);
 
     if (fileContents.empty()) {
-        std::cerr << "Tried to compile empty file, exiting" << std::endl;
-        return EXIT_FAILURE;
+        errs() << "Tried to compile empty file, exiting" << std::endl;
+        return nullptr;
     }
 
     std::vector<lexer_token> tokens;
-    if (!tokenizeFile(fileContents, tokens)) {
-        std::cerr << "Failed to tokenize file: " << argv[1] << std::endl;
-        return EXIT_FAILURE;
+    {
+        PhaseTimer timer("tokenizeFile", sourceName);
+        if (!tokenizeFile(fileContents, tokens)) {
+            errs() << "Failed to tokenize file: " << sourceName << std::endl;
+            return nullptr;
+        }
+    }
+
+    if (tokenCount) {
+        *tokenCount = tokens.size();
     }
 
     // for (auto &token : tokens) {
-    //     std::cout << tokenTypeToString(token.type) << " "
+    //     outs() << tokenTypeToString(token.type) << " "
     //               << std::string(token.str, token.str + token.len) << " "
     //               << std::endl;
     // }
 
-    llvmModule = new llvm::Module("my_module", llvmContext);
-
+    PhaseTimer timer("buildAST", sourceName);
     ExprAST *ast = buildAST(tokens);
     if (!ast) {
-        std::cerr << "Failed to build ast for file: " << argv[1] << std::endl;
+        errs() << "Failed to build ast for file: " << sourceName << std::endl;
+        return nullptr;
+    }
+
+    return ast;
+}
+
+// Generates a fresh llvmModule for the ast
+inline bool generateModule(ExprAST *ast, const std::string &sourceName)
+{
+    llvmModule = new llvm::Module("my_module", llvmContext);
+
+    {
+        PhaseTimer timer("codeGen", sourceName);
+        if (!ast->codeGen()) {
+            errs() << "Failed to generate code for file: " << sourceName << std::endl;
+            return false;
+        }
+    }
+
+    PhaseTimer timer("verify", sourceName);
+    bool broken = false;
+    {
+        llvm::raw_os_ostream errorOut(errs());
+        broken = llvm::verifyModule(*llvmModule, &errorOut);
+    }
+    if (broken) {
+        errs() << "Generated invalid code for file: " << sourceName << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Compiler state is global to the thread, so a compilation releases it when it ends. That way a
+// long running process like the server starts every compilation from a clean slate.
+struct CompilationScope {
+    CompilationScope() = default;
+    CompilationScope(const CompilationScope &) = delete;
+    CompilationScope &operator=(const CompilationScope &) = delete;
+
+    ~CompilationScope()
+    {
+        delete llvmModule;
+        llvmModule = nullptr;
+        llvmNamedValues.clear();
+        functionProtos.clear();
+        if (compileStats.enabled) {
+            resetCompileStats();
+        }
+        if (ast) {
+            deleteAst(ast);
+        }
+    }
+
+    ExprAST *ast = nullptr;
+};
+
+// Compiles the source into an object in memory, the whole compilation without any file I/O
+inline bool compileToObject(const std::string &source, const std::string &sourceName, const Options &options,
+                            llvm::SmallVector<char, 0> &object)
+{
+    CompilationScope scope;
+    scope.ast = buildASTFromSource(source, sourceName);
+    if (!scope.ast) {
+        return false;
+    }
+    applyFloatOptions(static_cast<TranslationUnitAST *>(scope.ast), options);
+
+    initializeTargets();
+    if (!generateModule(scope.ast, sourceName)) {
+        return false;
+    }
+
+    auto targetMachine = createTargetMachine(options);
+    if (!targetMachine) {
+        return false;
+    }
+
+    llvmModule->setTargetTriple(targetMachine->getTargetTriple().str());
+    llvmModule->setDataLayout(targetMachine->createDataLayout());
+    addBaseFeatures(*llvmModule, options.features);
+    if (!checkVectorAbi(*llvmModule, *targetMachine)) {
+        return false;
+    }
+    if (!options.multiversion.empty() && !multiversionModule(*llvmModule, options.multiversion, options.features)) {
+        return false;
+    }
+    optimizeModule(*llvmModule, *targetMachine, options.optLevel);
+
+    llvm::raw_svector_ostream dest(object);
+    return emitObject(*llvmModule, *targetMachine, dest);
+}
+
+// Compiles the source into the jit and returns the address of the entry function,
+// or nullptr on failure. The address stays valid for as long as the jit lives.
+inline void *jitCompile(llvm::orc::LLJIT &jit, const std::string &source, const std::string &entry,
+                        const Options &options)
+{
+    // The jit keeps its own copy of the module, so the compiler state goes when this returns
+    CompilationScope scope;
+    scope.ast = buildASTFromSource(source, "<jit>");
+    if (!scope.ast) {
+        return nullptr;
+    }
+    applyFloatOptions(static_cast<TranslationUnitAST *>(scope.ast), options);
+    if (!generateModule(scope.ast, "<jit>")) {
+        return nullptr;
+    }
+
+    auto targetMachine = createTargetMachine(options);
+    if (!targetMachine || !addModuleToJit(jit, *llvmModule, *targetMachine, options)) {
+        return nullptr;
+    }
+
+    return lookupJitSymbol(jit, entry);
+}
+
+inline int runInJit(const Options &options, ExprAST *ast)
+{
+    if (!generateModule(ast, options.inputFile)) {
         return EXIT_FAILURE;
     }
 
-    auto json = ast->toJson();
-    std::cout << "AST as json:\n" << json << "\n";
+    llvm::Function *entry = llvmModule->getFunction(options.entry);
+    if (!entry || entry->isDeclaration()) {
+        errs() << "Entry function " << options.entry << " is not defined in " << options.inputFile << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    std::ofstream outputFile("output.json");
-    outputFile << json;
-    outputFile.flush();
-    outputFile.close();
+    if (entry->arg_size() != options.entryArgs.size()) {
+        errs() << "Entry function " << options.entry << " takes " << entry->arg_size()
+                  << " arguments, but " << options.entryArgs.size() << " were given" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    ast->codeGen();
-    std::cout << "\nLLVM IR output:\n";
-    llvmModule->print(llvm::outs(), nullptr);
+    llvm::Function *wrapper = createEntryWrapper(*llvmModule, entry);
+    if (!wrapper) {
+        return EXIT_FAILURE;
+    }
 
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
+    auto jit = createJit();
+    auto targetMachine = createTargetMachine(options);
+    if (!jit || !targetMachine || !addModuleToJit(*jit, *llvmModule, *targetMachine, options)) {
+        return EXIT_FAILURE;
+    }
 
-    auto targetTriple = llvm::sys::getDefaultTargetTriple();
-    llvmModule->setTargetTriple(targetTriple);
+    auto *wrapperFunc = reinterpret_cast<EntryWrapperFunc>(lookupJitSymbol(*jit, wrapper->getName().str()));
+    if (!wrapperFunc) {
+        return EXIT_FAILURE;
+    }
 
-    std::string error;
-    auto target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
+    std::vector<EntryValue> args(entry->arg_size());
+    for (auto &param : entry->args()) {
+        const std::string &text = options.entryArgs[param.getArgNo()];
+        if (!parseEntryValue(text, param.getType(), args[param.getArgNo()])) {
+            errs() << "Argument " << text << " of " << options.entry << " is not a number" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    EntryValue result;
+    wrapperFunc(args.data(), &result);
+
+    outs() << options.entry << "(";
+    for (auto &param : entry->args()) {
+        outs() << (param.getArgNo() > 0 ? ", " : "") << formatEntryValue(args[param.getArgNo()], param.getType());
+    }
+    outs() << ") = " << formatEntryValue(result, entry->getReturnType()) << std::endl;
+
+    return EXIT_SUCCESS;
+}
+
+// Wraps a top level expression into a function with the EntryWrapperFunc signature. resultType
+// is the type of the expression.
+inline llvm::Function *createExprFunction(ExprAST *expr, const std::string &name, llvm::Type *&resultType)
+{
+    llvm::Type *slotType = llvm::Type::getInt64PtrTy(llvmContext);
+    llvm::FunctionType *funcType =
+        llvm::FunctionType::get(llvm::Type::getVoidTy(llvmContext), { slotType, slotType }, false);
+    llvm::Function *function = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, llvmModule);
+
+    llvmBuilder.SetInsertPoint(llvm::BasicBlock::Create(llvmContext, "entry", function));
+    llvmNamedValues.clear();
+
+    llvm::Value *value = expr->codeGen();
+    if (value && !value->getType()->isIntegerTy() && !value->getType()->isFloatingPointTy()) {
+        expr->logError("Only numbers can be printed");
+        value = nullptr;
+    }
+    if (!value) {
+        function->eraseFromParent();
+        return nullptr;
+    }
+
+    resultType = value->getType();
+    storeEntryValue(value, function->getArg(1), llvmBuilder);
+    llvmBuilder.CreateRetVoid();
+    return function;
+}
+
+// Definitions and externs end with a closing brace or semicolon, anything else is an
+// expression that is complete at the end of the line
+inline bool isReplChunkComplete(const std::string &chunk)
+{
+    int depth = 0;
+    for (char c : chunk) {
+        depth += c == '{' ? 1 : c == '}' ? -1 : 0;
+    }
+
+    size_t last = chunk.find_last_not_of(" \t\r\n");
+    if (depth > 0 || last == std::string::npos) {
+        return false;
+    }
+    if (chunk[last] == ';' || chunk[last] == '}') {
+        return true;
+    }
+
+    std::stringstream stream(chunk);
+    std::string firstWord;
+    stream >> firstWord;
+    return firstWord != "extern" && !isFunctionSpecifier(firstWord) && !isTypeName(firstWord);
+}
+
+struct ReplState {
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+    std::unordered_map<std::string, bool> definedFunctions;
+    int exprCount = 0;
+};
+
+// Releases what a chunk leaves behind. A chunk that fails also takes its prototypes back out of
+// functionProtos, those of an accepted one stay there and keep its AST alive.
+struct ReplChunkScope {
+    ReplChunkScope()
+        : savedProtos(functionProtos)
+    {
+    }
+    ReplChunkScope(const ReplChunkScope &) = delete;
+    ReplChunkScope &operator=(const ReplChunkScope &) = delete;
+
+    ~ReplChunkScope()
+    {
+        // The jit has its own copy of the module
+        delete llvmModule;
+        llvmModule = nullptr;
+        if (!accepted) {
+            functionProtos = savedProtos;
+        }
+        if (ast) {
+            deleteAst(ast);
+        }
+    }
+
+    ExprAST *ast = nullptr;
+    bool accepted = false;
+    std::unordered_map<std::string, PrototypeAST *> savedProtos;
+};
+
+// Every chunk gets its own small module that is handed to the jit, functions from earlier
+// chunks stay in the jit and are only declared again in the modules that call them
+inline void evaluateReplChunk(ReplState &state, std::string chunk, const Options &options)
+{
+    removeTrailingNewLines(chunk);
+
+    // The lexer never advances past a number or name that ends the input, so make sure an
+    // expression typed without a semicolon doesn't end in one
+    if (!chunk.empty() && chunk.back() != ';' && chunk.back() != '}') {
+        chunk += ";";
+    }
 
-    if (!target) {
-        std::cerr << error;
+    std::vector<lexer_token> tokens;
+    if (!tokenizeFile(chunk, tokens) || tokens.empty()) {
+        return;
+    }
+
+    ReplChunkScope scope;
+    bool isDecl = tokenEq(tokens[0], "extern") || isFunctionSpecifier(toString(tokens[0])) || tokenIsAType(tokens[0]);
+    if (isDecl) {
+        auto *unit = static_cast<TranslationUnitAST *>(buildAST(tokens));
+        if (!unit) {
+            return;
+        }
+        scope.ast = unit;
+        applyFloatOptions(unit, options);
+        for (auto *decl : unit->decls) {
+            auto *function = dynamic_cast<FunctionAST *>(decl);
+            if (function && state.definedFunctions.count(function->proto->name)) {
+                errs() << "Function " << function->proto->name << " is already defined" << std::endl;
+                return;
+            }
+        }
+
+        if (!generateModule(unit, "<repl>")) {
+            return;
+        }
+        exportInternalFunctions(*llvmModule, "<repl>");
+        if (!addModuleToJit(*state.jit, *llvmModule, *state.targetMachine, options)) {
+            return;
+        }
+
+        for (auto *decl : unit->decls) {
+            if (auto *function = dynamic_cast<FunctionAST *>(decl)) {
+                state.definedFunctions[function->proto->name] = true;
+                outs() << "Defined " << function->proto->name << std::endl;
+            } else if (auto *proto = dynamic_cast<PrototypeAST *>(decl)) {
+                outs() << "Declared " << proto->name << std::endl;
+            }
+        }
+        scope.ast = nullptr;
+        scope.accepted = true;
+    } else {
+        int index = 0;
+        ExprAST *expr = buildExpressionAST(tokens, index);
+        if (!expr) {
+            return;
+        }
+        scope.ast = expr;
+        auto *trailingToken = peekToken(tokens, index + 1);
+        if (trailingToken && !tokenEq(*trailingToken, ";")) {
+            logUnexpectedToken(*trailingToken);
+            return;
+        }
+
+        std::string name = "__cju_expr_" + std::to_string(state.exprCount++);
+        llvmModule = new llvm::Module("repl_expr", llvmContext);
+        llvm::Type *resultType = nullptr;
+        if (!createExprFunction(expr, name, resultType)) {
+            return;
+        }
+        exportInternalFunctions(*llvmModule, "<repl>");
+        if (!addModuleToJit(*state.jit, *llvmModule, *state.targetMachine, options)) {
+            return;
+        }
+
+        auto *exprFunc = reinterpret_cast<EntryWrapperFunc>(lookupJitSymbol(*state.jit, name));
+        if (exprFunc) {
+            EntryValue result;
+            exprFunc(nullptr, &result);
+            outs() << formatEntryValue(result, resultType) << std::endl;
+        }
+        scope.accepted = true;
+    }
+}
+
+inline int runRepl(const Options &options)
+{
+    ReplState state;
+    state.jit = createJit();
+    state.targetMachine = createTargetMachine(options);
+    if (!state.jit || !state.targetMachine) {
         return EXIT_FAILURE;
     }
 
-    auto cpu = "generic";
-    auto features = "";
+    std::string chunk;
+    std::string line;
+    outs() << "cju> " << std::flush;
+    while (std::getline(std::cin, line)) {
+        chunk += line + "\n";
+        if (isReplChunkComplete(chunk)) {
+            evaluateReplChunk(state, chunk, options);
+            chunk.clear();
+        }
+        outs() << (chunk.empty() ? "cju> " : "...> ") << std::flush;
+    }
+    outs() << std::endl;
 
-    llvm::TargetOptions opt;
-    auto rm = llvm::Optional<llvm::Reloc::Model>();
-    auto targetMachine = target->createTargetMachine(targetTriple, cpu, features, opt, rm);
+    return EXIT_SUCCESS;
+}
 
-    llvmModule->setDataLayout(targetMachine->createDataLayout());
+// Compiles options.inputFile into options.outputDir, the source is read from input when the input file is "-"
+inline int compile(const Options &options, std::istream &input)
+{
+    // Reports the timings when compile returns, no matter where
+    TimingSession timingSession(options);
+    CompilationScope scope;
+
+    if (options.stats) {
+        enableCompileStats(options.inputFile);
+    }
 
-    auto filename = "output.o";
-    std::error_code ec;
-    llvm::raw_fd_ostream dest(filename, ec, llvm::sys::fs::OF_None);
+    CompileCache cache;
+    if (!options.cacheDir.empty() && !initializeCache(cache, options)) {
+        return EXIT_FAILURE;
+    }
+
+    if (options.inputFile.empty()) {
+        printCacheStats(cache);
+        return EXIT_SUCCESS;
+    }
+
+    const char *inputFile = options.inputFile.c_str();
+
+    std::string fileContents;
+    {
+        PhaseTimer timer("readFile", inputFile);
+        if (options.inputFile == "-") {
+            fileContents.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        } else if (!readSourceFile(inputFile, fileContents)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!options.outputDir.empty()) {
+        if (std::error_code ec = llvm::sys::fs::create_directories(options.outputDir)) {
+            errs() << "Could not create output directory " << options.outputDir << ": " << ec.message()
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> cachedOutputs = compileOutputExtensions(options);
+    std::string jsonFilename = joinPath(options.outputDir, "output.json");
+    std::string filename = joinPath(options.outputDir, "output" + cachedOutputs[1]);
+    std::string cacheKey;
+    if (!options.cacheDir.empty() && !options.runInJit) {
+        cacheKey = computeCacheKey(fileContents, options);
+        if (cacheLookup(cache, cacheKey, cachedOutputs, options.outputDir)) {
+            outs() << "cju found " << inputFile << " in the cache. Outputted " << jsonFilename << " for AST and "
+                      << filename << " for compliation result" << std::endl;
+            if (options.cacheStats) {
+                printCacheStats(cache);
+            }
+            return EXIT_SUCCESS;
+        }
+    }
 
-    if (ec) {
-        std::cerr << "Could not open file: " << ec.message();
+    size_t tokenCount = 0;
+    ExprAST *ast = buildASTFromSource(fileContents, inputFile, &tokenCount);
+    if (!ast) {
         return EXIT_FAILURE;
     }
+    scope.ast = ast;
+    applyFloatOptions(static_cast<TranslationUnitAST *>(ast), options);
+    if (options.batch) {
+        enableBatchFunctions(static_cast<TranslationUnitAST *>(ast));
+    }
+
+    if (memoryReportEnabled()) {
+        memoryReport.tokenCount = tokenCount;
+        memoryReport.astNodeCount = countAstNodes(ast);
+    }
+    if (compileStats.enabled) {
+        recordAstStats(ast, tokenCount);
+    }
+
+    initializeTargets();
+
+    if (options.runInJit) {
+        return runInJit(options, ast);
+    }
 
-    llvm::legacy::PassManager pass;
-    auto fileType = llvm::CodeGenFileType::CGFT_ObjectFile;
+    {
+        PhaseTimer timer("astJson", inputFile);
+        auto json = ast->toJson();
+        outs() << "AST as json:\n" << json << "\n";
 
-    if (targetMachine->addPassesToEmitFile(pass, dest, nullptr, fileType)) {
-        std::cerr << "targetMachine can't emit a file of type " << fileType;
-        return 1;
+        std::ofstream outputFile(jsonFilename);
+        outputFile << json;
+        outputFile.flush();
+        outputFile.close();
     }
 
-    pass.run(*llvmModule);
-    dest.flush();
+    if (options.incremental) {
+        if (!emitIncrementalArchive(static_cast<TranslationUnitAST *>(ast), cache, options, filename)) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        if (!generateModule(ast, inputFile)) {
+            return EXIT_FAILURE;
+        }
+        if (memoryReportEnabled()) {
+            memoryReport.moduleInstructionCount = countInstructions(*llvmModule);
+            memoryReport.moduleBitcodeBytes = writeModuleBitcode(*llvmModule).size();
+        }
+        if (compileStats.enabled) {
+            recordIrStats(*llvmModule, false);
+        }
+        outs() << "\nLLVM IR output:\n";
+        {
+            llvm::raw_os_ostream out(outs());
+            llvmModule->print(out, nullptr);
+        }
 
-    std::cout << "\ncju compiled succesfully. Outputted output.json for AST and output.o for compliation result\n" << std::endl;
+        auto targetMachine = createTargetMachine(options);
+        if (!targetMachine) {
+            return EXIT_FAILURE;
+        }
+
+        llvmModule->setTargetTriple(targetMachine->getTargetTriple().str());
+        llvmModule->setDataLayout(targetMachine->createDataLayout());
+        addBaseFeatures(*llvmModule, options.features);
+        if (!checkVectorAbi(*llvmModule, *targetMachine)) {
+            return EXIT_FAILURE;
+        }
+        if (!options.multiversion.empty() &&
+            !multiversionModule(*llvmModule, options.multiversion, options.features)) {
+            return EXIT_FAILURE;
+        }
+
+        optimizeModule(*llvmModule, *targetMachine, options.optLevel);
+        if (memoryReportEnabled()) {
+            memoryReport.optimizedModuleInstructionCount = countInstructions(*llvmModule);
+            memoryReport.optimizedModuleBitcodeBytes = writeModuleBitcode(*llvmModule).size();
+        }
+        if (compileStats.enabled) {
+            recordIrStats(*llvmModule, true);
+        }
+
+        if (options.jobs > 0) {
+            if (!emitObjectArchiveParallel(*llvmModule, options, filename)) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            if (!emitObjectFile(*llvmModule, *targetMachine, filename)) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // Written once the object compiled, which checked that its vector types are passed like the
+    // header declares them
+    if (options.batch &&
+        !writeCHeader(static_cast<TranslationUnitAST *>(ast), inputFile, joinPath(options.outputDir, "output.h"))) {
+        return EXIT_FAILURE;
+    }
+
+    if (compileStats.enabled) {
+        recordMachineCodeStats(filename);
+        writeCompileStats(options.statsFile);
+    }
+
+    if (!cacheKey.empty()) {
+        cacheStore(cache, cacheKey, cachedOutputs, options.outputDir);
+        if (options.cacheStats) {
+            printCacheStats(cache);
+        }
+    }
+
+    outs() << "\ncju compiled succesfully. Outputted " << jsonFilename << " for AST and " << filename << " for compliation result\n" << std::endl;
 
     return EXIT_SUCCESS;
 }
 
+inline int run(int argc, char **argv)
+{
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.repl) {
+        initializeTargets();
+        return runRepl(options);
+    }
+
+    if (options.server) {
+        return runServer(options, compile);
+    }
+
+    return compile(options, std::cin);
+}
+
 } // namespace cju
@@ -0,0 +1,59 @@
+// Thin client of cju --server. Forwards the arguments, the working directory and stdin to the
+// server and prints what the compilation printed. Usage: cju-client [--socket path] [cju options] file
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+
+#include <climits>
+
+#include "protocol.hpp"
+
+int main(int argc, char **argv)
+{
+    std::string socketPath = cju::defaultSocketPath();
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg.compare(0, 9, "--socket=") == 0) {
+            socketPath = arg.substr(9);
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    // Only read stdin when the source comes from it, so that the client never waits on a terminal
+    std::string input;
+    if (std::find(args.begin(), args.end(), "-") != args.end()) {
+        input.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        std::cerr << "Could not get the working directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int fd = cju::connectToServer(socketPath);
+    if (fd < 0) {
+        std::cerr << "Could not connect to a cju server on " << socketPath << ", start one with cju --server"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> request { cwd, input };
+    request.insert(request.end(), args.begin(), args.end());
+
+    std::vector<std::string> response;
+    if (!cju::writeMessage(fd, request) || !cju::readMessage(fd, response) || response.size() != 3) {
+        std::cerr << "Lost the connection to the cju server" << std::endl;
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    std::cout << response[1] << std::flush;
+    std::cerr << response[2] << std::flush;
+    return std::atoi(response[0].c_str());
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "common.h"
+#include "ast.hpp"
+#include "backend.hpp"
+#include "cache.hpp"
+#include "multiversion.hpp"
+#include "options.hpp"
+#include "output.hpp"
+#include "stats.hpp"
+
+namespace cju
+{
+
+inline void collectCallees(ExprAST *node, std::set<std::string> &callees)
+{
+    if (auto *call = dynamic_cast<CallAST *>(node)) {
+        callees.insert(call->callee);
+    }
+    node->visitChildren([&](ExprAST *child) { collectCallees(child, callees); });
+}
+
+// The json of a function is its normalized AST, whitespace and comments don't change it.
+// A function also has to be recompiled when the signature of something it calls changes,
+// but not when only the body of the callee changes.
+inline std::string computeFunctionCacheKey(FunctionAST *function, const Options &options)
+{
+    // The exported names of static functions depend on the file
+    std::vector<std::string> fields { "function", function->toJson().dump(), unitSymbolSuffix(options.inputFile) };
+
+    std::set<std::string> callees;
+    collectCallees(function->body, callees);
+    for (auto &callee : callees) {
+        auto it = functionProtos.find(callee);
+        fields.push_back(it != functionProtos.end() ? it->second->toJson().dump() : "undeclared " + callee);
+    }
+
+    return hashCacheKey(options, fields);
+}
+
+inline bool compileFunctionObject(FunctionAST *function, llvm::TargetMachine &targetMachine, const Options &options,
+                                  llvm::SmallVector<char, 0> &object)
+{
+    llvmModule = new llvm::Module(function->proto->name, llvmContext);
+    llvmModule->setTargetTriple(targetMachine.getTargetTriple().str());
+    llvmModule->setDataLayout(targetMachine.createDataLayout());
+
+    bool success = function->codeGen() != nullptr;
+    if (success) {
+        addBaseFeatures(*llvmModule, options.features);
+        success = checkVectorAbi(*llvmModule, targetMachine);
+    }
+    if (success) {
+        exportInternalFunctions(*llvmModule, options.inputFile);
+        if (!options.multiversion.empty()) {
+            success = multiversionModule(*llvmModule, options.multiversion, options.features);
+        }
+    }
+    if (success) {
+        if (compileStats.enabled) {
+            recordIrStats(*llvmModule, false);
+        }
+        optimizeModule(*llvmModule, targetMachine, options.optLevel);
+        if (compileStats.enabled) {
+            recordIrStats(*llvmModule, true);
+        }
+
+        llvm::raw_svector_ostream dest(object);
+        success = emitObject(*llvmModule, targetMachine, dest);
+    }
+
+    delete llvmModule;
+    llvmModule = nullptr;
+    return success;
+}
+
+// Compiles every function of the unit into an object of its own and writes them all into
+// an archive. Objects of functions whose fingerprint is already in the cache are reused as
+// they are, so only the functions that changed go through code generation and the backend.
+// Since every function is optimized on its own, nothing is inlined across functions, and static
+// functions are exported from their objects.
+inline bool emitIncrementalArchive(TranslationUnitAST *unit, const CompileCache &cache, const Options &options,
+                                   const std::string &filename)
+{
+    std::vector<FunctionAST *> functions;
+    for (auto *decl : unit->decls) {
+        if (auto *function = dynamic_cast<FunctionAST *>(decl)) {
+            functions.push_back(function);
+            functionProtos[function->proto->name] = function->proto;
+        } else if (auto *proto = dynamic_cast<PrototypeAST *>(decl)) {
+            functionProtos.emplace(proto->name, proto);
+        }
+    }
+
+    std::set<std::string> names;
+    for (auto *function : functions) {
+        if (!names.insert(function->proto->name).second) {
+            errs() << "Function " << function->proto->name << " cannot be redefined" << std::endl;
+            return false;
+        }
+    }
+
+    auto targetMachine = createTargetMachine(options);
+    if (!targetMachine) {
+        return false;
+    }
+
+    std::vector<llvm::SmallVector<char, 0>> objects(functions.size());
+    std::vector<std::string> memberNames;
+    unsigned reusedCount = 0;
+    for (size_t i = 0; i < functions.size(); ++i) {
+        FunctionAST *function = functions[i];
+        memberNames.push_back(function->proto->name + ".o");
+
+        std::string key = computeFunctionCacheKey(function, options);
+        std::string cachedObject;
+        if (readCacheEntry(cache, key, ".fo", cachedObject)) {
+            objects[i].append(cachedObject.begin(), cachedObject.end());
+            reusedCount++;
+            continue;
+        }
+
+        if (!compileFunctionObject(function, *targetMachine, options, objects[i])) {
+            errs() << "Failed to generate code for function " << function->proto->name << std::endl;
+            return false;
+        }
+        writeCacheEntry(cache, key, ".fo", std::string(objects[i].data(), objects[i].size()));
+    }
+
+    outs() << "Incremental compilation reused " << reusedCount << " and recompiled "
+              << functions.size() - reusedCount << " of " << functions.size() << " functions" << std::endl;
+
+    return writeObjectArchive(filename, targetMachine->getTargetTriple(), objects, memberNames);
+}
+
+} // namespace cju
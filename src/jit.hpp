@@ -0,0 +1,185 @@
+#pragma once
+
+#include "common.h"
+#include "ast.hpp"
+#include "backend.hpp"
+#include "options.hpp"
+#include "output.hpp"
+#include "runtime.h"
+
+namespace cju
+{
+
+// An argument or the result of a jitted entry function. Integers travel as int64_t and floats as
+// double, so that neither loses any precision on the way.
+union EntryValue {
+    int64_t integer;
+    double real;
+};
+
+// Signature of the wrapper generated around a jitted entry function, see createEntryWrapper
+using EntryWrapperFunc = void (*)(const EntryValue *args, EntryValue *result);
+
+inline std::unique_ptr<llvm::orc::LLJIT> createJit()
+{
+    initializeTargets();
+    auto jit = llvm::orc::LLJITBuilder().create();
+    if (!jit) {
+        errs() << "Failed to create jit: " << llvm::toString(jit.takeError()) << std::endl;
+        return nullptr;
+    }
+
+    // Let jitted code call functions from the host process, e.g. externs implemented in C
+    char globalPrefix = (*jit)->getDataLayout().getGlobalPrefix();
+    auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(globalPrefix);
+    if (!generator) {
+        errs() << "Failed to create jit symbol generator: " << llvm::toString(generator.takeError()) << std::endl;
+        return nullptr;
+    }
+    (*jit)->getMainJITDylib().addGenerator(std::move(*generator));
+
+    // The runtime library is linked into cju itself, but its symbols aren't exported from the executable
+    llvm::orc::SymbolMap runtimeSymbols;
+    runtimeSymbols[(*jit)->mangleAndIntern("cju_parallel_for")] =
+        llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&cju_parallel_for), llvm::JITSymbolFlags::Exported);
+    if (llvm::Error error = (*jit)->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(runtimeSymbols)))) {
+        errs() << "Failed to add the runtime library to the jit: " << llvm::toString(std::move(error)) << std::endl;
+        return nullptr;
+    }
+
+    return std::move(*jit);
+}
+
+// Optimizes the module and hands a copy of it to the jit. The jit owns the contexts of
+// the modules it compiles, so the module is moved out of our global context through bitcode.
+inline bool addModuleToJit(llvm::orc::LLJIT &jit, llvm::Module &module, llvm::TargetMachine &targetMachine,
+                           const Options &options)
+{
+    module.setTargetTriple(jit.getTargetTriple().str());
+    module.setDataLayout(jit.getDataLayout());
+    addBaseFeatures(module, options.features);
+    optimizeModule(module, targetMachine, options.optLevel);
+
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto jitModule = parseModuleBitcode(writeModuleBitcode(module), *context);
+    if (!jitModule) {
+        return false;
+    }
+
+    llvm::orc::ThreadSafeModule threadSafeModule(std::move(jitModule), std::move(context));
+    if (llvm::Error error = jit.addIRModule(std::move(threadSafeModule))) {
+        errs() << "Failed to add module to jit: " << llvm::toString(std::move(error)) << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+inline void *lookupJitSymbol(llvm::orc::LLJIT &jit, const std::string &name)
+{
+    auto symbol = jit.lookup(name);
+    if (!symbol) {
+        errs() << "Failed to find " << name << " in jit: " << llvm::toString(symbol.takeError()) << std::endl;
+        return nullptr;
+    }
+
+    return reinterpret_cast<void *>(static_cast<uintptr_t>(symbol->getAddress()));
+}
+
+// Stores an integer or floating point value into the EntryValue at slot, which is an i64*
+inline void storeEntryValue(llvm::Value *value, llvm::Value *slot, llvm::IRBuilder<> &builder)
+{
+    llvm::Type *int64Type = builder.getInt64Ty();
+    if (value->getType()->isFloatingPointTy()) {
+        value = builder.CreateBitCast(convertValue(value, builder.getDoubleTy(), builder), int64Type);
+    } else {
+        value = convertValue(value, int64Type, builder);
+    }
+    builder.CreateStore(value, slot);
+}
+
+// Generates an EntryWrapperFunc that unpacks the arguments for the entry function from an array
+// of EntryValues and stores its result in another one, so that any entry can be called from C++
+inline llvm::Function *createEntryWrapper(llvm::Module &module, llvm::Function *entry)
+{
+    llvm::LLVMContext &context = module.getContext();
+    llvm::Type *int64Type = llvm::Type::getInt64Ty(context);
+    llvm::Type *slotType = llvm::PointerType::getUnqual(int64Type);
+
+    llvm::Type *returnType = entry->getReturnType();
+    if (!returnType->isFloatingPointTy() && !returnType->isIntegerTy()) {
+        errs() << "Entry function " << entry->getName().str() << " has an unsupported return type" << std::endl;
+        return nullptr;
+    }
+
+    llvm::FunctionType *wrapperType =
+        llvm::FunctionType::get(llvm::Type::getVoidTy(context), { slotType, slotType }, false);
+    llvm::Function *wrapper = llvm::Function::Create(wrapperType, llvm::Function::ExternalLinkage,
+                                                     "__cju_entry_" + entry->getName().str(), &module);
+
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", wrapper));
+    llvm::Value *argsPtr = wrapper->getArg(0);
+
+    std::vector<llvm::Value *> args;
+    for (auto &param : entry->args()) {
+        llvm::Type *type = param.getType();
+        if (!type->isFloatingPointTy() && !type->isIntegerTy()) {
+            errs() << "Entry function " << entry->getName().str() << " has an unsupported argument type" << std::endl;
+            wrapper->eraseFromParent();
+            return nullptr;
+        }
+        llvm::Value *argPtr = builder.CreateConstInBoundsGEP1_64(int64Type, argsPtr, param.getArgNo());
+        llvm::Value *arg = builder.CreateLoad(int64Type, argPtr);
+        if (type->isFloatingPointTy()) {
+            arg = builder.CreateBitCast(arg, builder.getDoubleTy());
+        }
+        args.push_back(convertValue(arg, type, builder));
+    }
+
+    storeEntryValue(builder.CreateCall(entry, args), wrapper->getArg(1), builder);
+    builder.CreateRetVoid();
+
+    return wrapper;
+}
+
+// Parses an argument for a parameter of the given type. Integers are read exactly, anything else
+// is converted like a C cast of the number.
+inline bool parseEntryValue(const std::string &text, llvm::Type *type, EntryValue &value)
+{
+    int64_t integer = 0;
+    bool isInteger = !llvm::StringRef(text).getAsInteger(10, integer);
+
+    char *end = nullptr;
+    double real = std::strtod(text.c_str(), &end);
+    if (!isInteger && (text.empty() || *end != '\0')) {
+        return false;
+    }
+
+    if (type->isIntegerTy()) {
+        value.integer = isInteger ? integer : static_cast<int64_t>(real);
+    } else {
+        value.real = real;
+    }
+    return true;
+}
+
+// Prints integers exactly and floats with the fewest digits that still read back as the same value
+inline std::string formatEntryValue(const EntryValue &value, llvm::Type *type)
+{
+    if (type->isIntegerTy()) {
+        return std::to_string(value.integer);
+    }
+
+    bool isFloat = type->isFloatTy();
+    for (int precision = 1;; ++precision) {
+        std::ostringstream text;
+        text << std::setprecision(precision) << value.real;
+        double parsed = std::strtod(text.str().c_str(), nullptr);
+        if (precision >= 17 || (isFloat ? static_cast<float>(parsed) == static_cast<float>(value.real)
+                                         : parsed == value.real)) {
+            return text.str();
+        }
+    }
+}
+
+} // namespace cju
@@ -0,0 +1,80 @@
+#include "libcju.h"
+#include "cju.hpp"
+
+namespace cju
+{
+
+// Sends what LLVM reports while compiling, e.g. loop hints it couldn't follow, to errs() instead of
+// stderr. Errors no longer end the process either.
+struct DiagnosticCollector : llvm::DiagnosticHandler {
+    bool handleDiagnostics(const llvm::DiagnosticInfo &info) override
+    {
+        std::string message;
+        llvm::raw_string_ostream stream(message);
+        // cju emits no debug info, so name the function instead of printing an unknown location
+        auto *optimization = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&info);
+        if (optimization && !optimization->isLocationAvailable()) {
+            stream << optimization->getFunction().getName() << ": " << optimization->getMsg();
+        } else {
+            llvm::DiagnosticPrinterRawOStream printer(stream);
+            info.print(printer);
+        }
+        errs() << llvm::LLVMContext::getDiagnosticMessagePrefix(info.getSeverity()) << ": "
+               << stream.str() << "\n";
+        return true;
+    }
+};
+
+// Installs a DiagnosticCollector on the context until it goes out of scope
+struct CollectDiagnostics {
+    explicit CollectDiagnostics(llvm::LLVMContext &context)
+        : context(context)
+        , oldHandler(context.getDiagnosticHandler())
+    {
+        // Respecting the filters drops the remarks nobody asked for with -pass-remarks
+        context.setDiagnosticHandler(std::make_unique<DiagnosticCollector>(), true);
+    }
+
+    ~CollectDiagnostics()
+    {
+        context.setDiagnosticHandler(std::move(oldHandler));
+    }
+
+    llvm::LLVMContext &context;
+    std::unique_ptr<llvm::DiagnosticHandler> oldHandler;
+};
+
+CompileResult compileSource(const std::string &source, const CompileOptions &compileOptions)
+{
+    Options options;
+    options.optLevel = std::min(compileOptions.optLevel, 3u);
+    options.cpu = compileOptions.cpu;
+    options.features = compileOptions.features;
+
+    CompileResult result;
+    std::ostringstream errors;
+    {
+        // Nothing is printed, the errors end up in the diagnostics
+        std::ostream discardedOutput(nullptr);
+        OutputRedirect redirect(discardedOutput, errors);
+        CollectDiagnostics collect(llvmContext);
+
+        llvm::SmallVector<char, 0> object;
+        result.success = compileToObject(source, compileOptions.sourceName, options, object);
+        if (result.success) {
+            result.object.assign(object.data(), object.size());
+        }
+    }
+
+    std::istringstream lines(errors.str());
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (!line.empty()) {
+            result.diagnostics.push_back(line);
+        }
+    }
+
+    return result;
+}
+
+} // namespace cju
@@ -0,0 +1,28 @@
+#pragma once
+
+// Embeddable interface of cju. Compiles a source buffer into an object file in memory, without
+// touching the file system or exiting the process, and may be called from many threads at once.
+// Link with libcju.a and the LLVM libraries, see build.sh.
+
+#include <string>
+#include <vector>
+
+namespace cju
+{
+
+struct CompileOptions {
+    unsigned optLevel = 0;
+    std::string cpu = "generic";
+    std::string features; // e.g. +avx2,+fma
+    std::string sourceName = "<source>"; // Only used in diagnostics
+};
+
+struct CompileResult {
+    bool success = false;
+    std::string object; // Object file for the host target, empty unless success is set
+    std::vector<std::string> diagnostics;
+};
+
+CompileResult compileSource(const std::string &source, const CompileOptions &options = CompileOptions());
+
+} // namespace cju
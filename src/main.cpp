@@ -1,3 +1,4 @@
+#define CJU_MEMORY_IMPLEMENTATION
 #include "cju.hpp"
 
 int main(int argc, char **argv)
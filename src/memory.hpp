@@ -0,0 +1,218 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+namespace cju
+{
+
+// Counted by the replacement operator new below. The counters are global, so allocations
+// made by other threads while a phase runs are attributed to that phase as well.
+static std::atomic<bool> allocationCountingEnabled { false };
+static std::atomic<uint64_t> allocationCount { 0 };
+static std::atomic<uint64_t> allocatedBytes { 0 };
+
+struct AllocationCounters {
+    uint64_t count;
+    uint64_t bytes;
+};
+
+inline AllocationCounters readAllocationCounters()
+{
+    return { allocationCount.load(std::memory_order_relaxed), allocatedBytes.load(std::memory_order_relaxed) };
+}
+
+inline void countAllocation(size_t size)
+{
+    if (allocationCountingEnabled.load(std::memory_order_relaxed)) {
+        allocationCount.fetch_add(1, std::memory_order_relaxed);
+        allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+#ifdef __cpp_aligned_new
+// posix_memalign takes alignments that are powers of two and multiples of sizeof(void *), and
+// memory from it is released with free like the rest
+inline void *allocateAligned(size_t size, std::align_val_t alignment)
+{
+    size_t align = std::max(static_cast<size_t>(alignment), sizeof(void *));
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, align, size ? size : 1) == 0 ? ptr : nullptr;
+}
+#endif
+
+inline uint64_t peakRssBytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// Sizes of what the phases produced, filled in by run() when the memory report is enabled
+struct MemoryReport {
+    std::string filename;
+    std::string inputFile;
+    uint64_t tokenCount = 0;
+    uint64_t astNodeCount = 0;
+    uint64_t moduleInstructionCount = 0;
+    uint64_t moduleBitcodeBytes = 0;
+    uint64_t optimizedModuleInstructionCount = 0;
+    uint64_t optimizedModuleBitcodeBytes = 0;
+};
+
+static MemoryReport memoryReport;
+
+inline bool memoryReportEnabled()
+{
+    return !memoryReport.filename.empty();
+}
+
+inline void enableMemoryReport(const std::string &filename, const std::string &inputFile)
+{
+    memoryReport.filename = filename;
+    memoryReport.inputFile = inputFile;
+    allocationCountingEnabled = true;
+}
+
+inline uint64_t countInstructions(const llvm::Module &module)
+{
+    uint64_t count = 0;
+    for (auto &function : module) {
+        count += function.getInstructionCount();
+    }
+    return count;
+}
+
+} // namespace cju
+
+// Replaces the global operator new and delete, so must only be defined in a single translation unit
+#ifdef CJU_MEMORY_IMPLEMENTATION
+
+void *operator new(size_t size)
+{
+    cju::countAllocation(size);
+    void *ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        // Built without exceptions like LLVM, so fail the same way LLVM does
+        llvm::report_bad_alloc_error("Allocation failed");
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    cju::countAllocation(size);
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+#ifdef __cpp_aligned_new
+// Types aligned beyond what malloc guarantees, which C++17 allocates through these
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    cju::countAllocation(size);
+    void *ptr = cju::allocateAligned(size, alignment);
+    if (!ptr) {
+        llvm::report_bad_alloc_error("Allocation failed");
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    cju::countAllocation(size);
+    return cju::allocateAligned(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, alignment, tag);
+}
+#endif
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+#ifdef __cpp_aligned_new
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+#endif // CJU_MEMORY_IMPLEMENTATION
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "common.h"
+#include "output.hpp"
+
+namespace cju
+{
+
+// Bits of the first feature word of __cpu_model, the same ones __builtin_cpu_supports tests.
+// libgcc and compiler-rt both fill it in from cpuid and only report AVX and AVX-512 when the
+// OS saves their registers.
+enum CpuFeatureBit : uint32_t {
+    cpuPopcnt = 1u << 2,
+    cpuSse42 = 1u << 8,
+    cpuAvx = 1u << 9,
+    cpuAvx2 = 1u << 10,
+    cpuFma = 1u << 14,
+    cpuAvx512f = 1u << 15,
+    cpuBmi = 1u << 16,
+    cpuBmi2 = 1u << 17,
+    cpuAvx512vl = 1u << 20,
+    cpuAvx512bw = 1u << 21,
+    cpuAvx512dq = 1u << 22,
+    cpuAvx512cd = 1u << 23,
+};
+
+// Instruction set levels of --multiversion, from the oldest to the newest. A variant is only
+// picked when the cpu has every feature it is compiled with.
+struct IsaLevel {
+    const char *name;
+    const char *targetFeatures;
+    uint32_t cpuFeatures;
+};
+
+static const IsaLevel isaLevels[] = {
+    { "sse4.2", "+sse4.2,+popcnt", cpuSse42 | cpuPopcnt },
+    { "avx2", "+sse4.2,+popcnt,+avx,+avx2,+fma,+bmi,+bmi2",
+      cpuSse42 | cpuPopcnt | cpuAvx | cpuAvx2 | cpuFma | cpuBmi | cpuBmi2 },
+    { "avx512", "+sse4.2,+popcnt,+avx,+avx2,+fma,+bmi,+bmi2,+avx512f,+avx512vl,+avx512bw,+avx512dq,+avx512cd",
+      cpuSse42 | cpuPopcnt | cpuAvx | cpuAvx2 | cpuFma | cpuBmi | cpuBmi2 | cpuAvx512f | cpuAvx512vl |
+          cpuAvx512bw | cpuAvx512dq | cpuAvx512cd },
+};
+
+inline const IsaLevel *findIsaLevel(const std::string &name)
+{
+    for (auto &level : isaLevels) {
+        if (name == level.name) {
+            return &level;
+        }
+    }
+    return nullptr;
+}
+
+// Parses a comma separated list of levels into the order of isaLevels without duplicates
+inline bool parseIsaLevels(const std::string &list, std::vector<std::string> &levels)
+{
+    std::set<std::string> names;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!findIsaLevel(item)) {
+            return false;
+        }
+        names.insert(item);
+    }
+
+    levels.clear();
+    for (auto &level : isaLevels) {
+        if (names.count(level.name)) {
+            levels.push_back(level.name);
+        }
+    }
+    return !levels.empty();
+}
+
+// A target-features attribute replaces the features of the target machine, so functions that have
+// one for their instruction set, like the simd clones, get the -mattr features in front of it
+inline void addBaseFeatures(llvm::Module &module, const std::string &baseFeatures)
+{
+    if (baseFeatures.empty()) {
+        return;
+    }
+    for (auto &function : module) {
+        if (function.hasFnAttribute("target-features")) {
+            llvm::StringRef features = function.getFnAttribute("target-features").getValueAsString();
+            function.addFnAttr("target-features", baseFeatures + "," + features.str());
+        }
+    }
+}
+
+// Widest vector a function takes or returns, 0 without vectors. x86-64 only passes vectors wider
+// than 128 bits in ymm or zmm registers when the function is compiled with AVX or AVX-512, and in
+// several xmm registers otherwise.
+inline unsigned vectorAbiBits(const llvm::Function &function)
+{
+    unsigned bits = 0;
+    auto addType = [&](llvm::Type *type) {
+        if (type->isVectorTy()) {
+            bits = std::max(bits, static_cast<unsigned>(type->getPrimitiveSizeInBits()));
+        }
+    };
+    addType(function.getReturnType());
+    for (auto &arg : function.args()) {
+        addType(arg.getType());
+    }
+    return bits;
+}
+
+// Exported functions with 256 or 512 bit vectors are only called correctly through __m256 or __m512
+// when the target passes them in ymm or zmm registers like C compilers do with AVX or AVX-512.
+// Functions with target features of their own, the simd clones, follow the vector function ABI.
+inline bool checkVectorAbi(const llvm::Module &module, const llvm::TargetMachine &targetMachine)
+{
+    if (targetMachine.getTargetTriple().getArch() != llvm::Triple::x86_64) {
+        return true;
+    }
+    for (auto &function : module) {
+        if (function.hasLocalLinkage() || function.hasFnAttribute("target-features")) {
+            continue;
+        }
+        unsigned bits = vectorAbiBits(function);
+        const char *feature = bits > 256 ? "avx512f" : bits > 128 ? "avx" : nullptr;
+        if (feature && !targetMachine.getMCSubtargetInfo()->checkFeatures(std::string("+") + feature)) {
+            errs() << "Function " << function.getName().str() << " passes a " << bits
+                   << " bit vector, which needs -mattr=+" << feature << " or a -mcpu with it to be passed like __m"
+                   << bits << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the variant for the best level the cpu supports, or the default one. Runs while the
+// dynamic linker processes relocations, before any constructor, so it initializes __cpu_model first.
+inline llvm::Function *createIfuncResolver(llvm::Module &module, llvm::Function &function,
+                                           const std::vector<std::pair<const IsaLevel *, llvm::Function *>> &variants,
+                                           const std::string &name)
+{
+    llvm::LLVMContext &context = module.getContext();
+    llvm::Type *int32Type = llvm::Type::getInt32Ty(context);
+    auto *resolverType = llvm::FunctionType::get(function.getType(), false);
+    llvm::Function *resolver =
+        llvm::Function::Create(resolverType, llvm::GlobalValue::InternalLinkage, name + ".resolver", &module);
+
+    llvm::FunctionCallee cpuInit =
+        module.getOrInsertFunction("__cpu_indicator_init", llvm::FunctionType::get(llvm::Type::getVoidTy(context), false));
+    // struct { unsigned vendor, type, subtype; unsigned features[1]; }
+    auto *cpuModelType = llvm::StructType::get(context, { int32Type, int32Type, int32Type, llvm::ArrayType::get(int32Type, 1) });
+    llvm::Constant *cpuModel = module.getOrInsertGlobal("__cpu_model", cpuModelType);
+
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", resolver));
+    builder.CreateCall(cpuInit);
+    llvm::Value *featuresAddress = builder.CreateInBoundsGEP(
+        cpuModelType, cpuModel, { builder.getInt32(0), builder.getInt32(3), builder.getInt32(0) });
+    llvm::Value *features = builder.CreateLoad(int32Type, featuresAddress, "features");
+
+    for (auto it = variants.rbegin(); it != variants.rend(); ++it) {
+        llvm::Value *required = builder.getInt32(it->first->cpuFeatures);
+        llvm::Value *supported = builder.CreateICmpEQ(builder.CreateAnd(features, required), required);
+        auto *selectBlock = llvm::BasicBlock::Create(context, it->first->name, resolver);
+        auto *nextBlock = llvm::BasicBlock::Create(context, "next", resolver);
+        builder.CreateCondBr(supported, selectBlock, nextBlock);
+
+        builder.SetInsertPoint(selectBlock);
+        builder.CreateRet(it->second);
+        builder.SetInsertPoint(nextBlock);
+    }
+    builder.CreateRet(&function);
+
+    verifyFunction(*resolver);
+    return resolver;
+}
+
+// Adds the internal functions and linkonce cju.* helpers the given ones reference, directly or through
+// other such functions, so that outlined parallel loop bodies passed as pointers get variants too
+inline void addReferencedInternalFunctions(std::vector<llvm::Function *> &functions)
+{
+    std::set<llvm::Function *> seen(functions.begin(), functions.end());
+    std::vector<llvm::Constant *> constants;
+    for (size_t i = 0; i < functions.size(); ++i) {
+        for (auto &block : *functions[i]) {
+            for (auto &inst : block) {
+                for (auto &operand : inst.operands()) {
+                    if (auto *constant = llvm::dyn_cast<llvm::Constant>(operand)) {
+                        constants.push_back(constant);
+                    }
+                }
+            }
+        }
+
+        while (!constants.empty()) {
+            llvm::Constant *constant = constants.back();
+            constants.pop_back();
+            auto *function = llvm::dyn_cast<llvm::Function>(constant);
+            if (function) {
+                if (!function->isDeclaration() && (function->hasLocalLinkage() || function->hasLinkOnceODRLinkage()) &&
+                    !function->hasFnAttribute("target-features") && seen.insert(function).second) {
+                    functions.push_back(function);
+                }
+            } else if (llvm::isa<llvm::ConstantExpr>(constant) || llvm::isa<llvm::ConstantAggregate>(constant)) {
+                for (auto &operand : constant->operands()) {
+                    constants.push_back(llvm::cast<llvm::Constant>(operand));
+                }
+            }
+        }
+    }
+}
+
+// Compiles every exported function once more for each level and binds its name to the best variant
+// through an ifunc at load time. The original body stays as the variant for older cpus. Calls inside
+// a variant go straight to the variant of the callee for the same level, so only callers from outside
+// the object pay for the indirection. The internal functions a variant references get a copy for its
+// level as well. Functions that already have target features, like the simd clones, are left alone.
+inline bool multiversionModule(llvm::Module &module, const std::vector<std::string> &levelNames,
+                               const std::string &baseFeatures)
+{
+    llvm::Triple triple(module.getTargetTriple());
+    if (triple.getArch() != llvm::Triple::x86_64 || !triple.isOSBinFormatELF()) {
+        errs() << "--multiversion needs an x86-64 ELF target, the variants are bound through an ifunc" << std::endl;
+        return false;
+    }
+
+    // The variants of a function with wide vectors would each pass them differently
+    std::vector<llvm::Function *> functions;
+    for (auto &function : module) {
+        if (!function.isDeclaration() && function.hasExternalLinkage() &&
+            !function.hasFnAttribute("target-features") && vectorAbiBits(function) <= 128) {
+            functions.push_back(&function);
+        }
+    }
+    size_t exportedCount = functions.size();
+    addReferencedInternalFunctions(functions);
+
+    std::vector<const IsaLevel *> levels;
+    for (auto &name : levelNames) {
+        levels.push_back(findIsaLevel(name));
+    }
+
+    std::vector<std::map<llvm::Function *, llvm::Function *>> variants(levels.size());
+    for (size_t i = 0; i < levels.size(); ++i) {
+        std::string features = levels[i]->targetFeatures;
+        if (!baseFeatures.empty()) {
+            features = baseFeatures + "," + features;
+        }
+        llvm::ValueToValueMapTy levelMap;
+        for (auto *function : functions) {
+            llvm::ValueToValueMapTy valueMap;
+            llvm::Function *clone = llvm::CloneFunction(function, valueMap);
+            clone->setName(function->getName() + "." + levels[i]->name);
+            clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+            clone->addFnAttr("target-features", features);
+            variants[i][function] = clone;
+            levelMap[function] = clone;
+        }
+
+        // Points calls, and functions passed as pointers, to the variants of the same level
+        for (auto &entry : variants[i]) {
+            for (auto &block : *entry.second) {
+                for (auto &inst : block) {
+                    llvm::RemapInstruction(&inst, levelMap,
+                                           llvm::RF_NoModuleLevelChanges | llvm::RF_IgnoreMissingLocals);
+                }
+            }
+        }
+    }
+
+    functions.resize(exportedCount);
+    for (auto *function : functions) {
+        std::string name = function->getName().str();
+        function->setName(name + ".default");
+        function->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+        std::vector<std::pair<const IsaLevel *, llvm::Function *>> functionVariants;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            functionVariants.emplace_back(levels[i], variants[i][function]);
+        }
+        llvm::Function *resolver = createIfuncResolver(module, *function, functionVariants, name);
+        llvm::GlobalIFunc::create(function->getFunctionType(), function->getAddressSpace(),
+                                  llvm::GlobalValue::ExternalLinkage, name, resolver, &module);
+    }
+    return true;
+}
+
+} // namespace cju
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "common.h"
+#include "multiversion.hpp"
+#include "output.hpp"
+
+namespace cju
+{
+
+// Which floating point a * b + c may be computed with a single rounding. off never fuses, on fuses
+// within one expression like C's FP_CONTRACT, and fast lets the backend fuse wherever it finds them
+enum class FpContract { off, on, fast };
+
+inline const char *fpContractName(FpContract contract)
+{
+    return contract == FpContract::fast ? "fast" : contract == FpContract::on ? "on" : "off";
+}
+
+struct Options {
+    std::string inputFile; // "-" reads the source from stdin
+    std::string outputDir; // output.json and the object are written here, defaults to the working directory
+    unsigned optLevel = 0;
+    std::string cpu = "generic";
+    std::string features;
+    unsigned jobs = 0; // 0 means the whole module is emitted as one object on the calling thread
+    // Every exported function of numbers also gets a name_batch entry point over arrays, and
+    // output.h declares the functions of the object
+    bool batch = false;
+    // Exported functions are also compiled for these levels of isaLevels and bound to the best one at load time
+    std::vector<std::string> multiversion;
+    // Floating point rewrites allowed in functions not declared precise
+    bool fastMath = false;
+    FpContract fpContract = FpContract::off;
+
+    // --run compiles into a jit and calls entry with entryArgs instead of writing any output files
+    bool runInJit = false;
+    std::string entry;
+    // Kept as text until the parameter types are known, so that integers are never rounded
+    std::vector<std::string> entryArgs;
+
+    bool repl = false;
+
+    // Serve compilations from cju-client on a Unix domain socket, defaults to defaultSocketPath()
+    bool server = false;
+    std::string socketPath;
+
+    // Outputs are looked up in and stored to the cache when cacheDir is set
+    std::string cacheDir;
+    uint64_t cacheMaxSize = 256 * 1024 * 1024;
+    bool cacheStats = false;
+    // Every function is compiled into its own object, which is cached by a fingerprint of the function
+    bool incremental = false;
+
+    // Wall and cpu time of every phase, printed after compiling and/or written as a Chrome trace
+    bool timeReport = false;
+    std::string traceFile;
+    // Allocations and peak RSS of every phase, written as json
+    std::string memoryReportFile;
+    // Counters of tokens, AST nodes, IR and machine code per function, printed or written as json
+    bool stats = false;
+    std::string statsFile;
+};
+
+inline void printUsage(const char* programName)
+{
+    outs() << "Usage: " << programName << " [options] [file]\n"
+              << "The file - reads the source from stdin\n"
+              << "Options:\n"
+              << "  -O<level>    Optimization level 0-3, defaults to 0\n"
+              << "  -mcpu=name   Target cpu, defaults to generic\n"
+              << "  -mattr=list  Target features, e.g. +avx2,+fma\n"
+              << "  -ffast-math  Let float operations be reassociated and assume no NaNs, infinities or signed zeros\n"
+              << "  -ffp-contract=off|on|fast  Fuse a * b + c into fma never, within an expression or anywhere,\n"
+              << "               defaults to off\n"
+              << "  -j[count]    Split the module and run code generation on [count] threads, also -j=count,\n"
+              << "               outputs an archive of the partitions. Defaults to all cores\n"
+              << "  --run        Compile into a jit and call the entry function in process\n"
+              << "  --entry name Function to call with --run\n"
+              << "  --args list  Comma separated arguments for the entry function, e.g. 3,4\n"
+              << "  --repl       Read definitions and expressions from stdin and evaluate them in a jit\n"
+              << "  --output-dir dir  Write output.json and the object to dir instead of the working directory\n"
+              << "  --batch      Add name_batch(a, b, out, n) array entry points for every exported function\n"
+              << "               of numbers and write output.h declaring the functions of the object\n"
+              << "  --multiversion=list  Also compile every exported function for sse4.2, avx2 and/or avx512\n"
+              << "               and pick the best variant for the cpu when the object is loaded\n"
+              << "  --server     Keep running and compile for cju-client over a Unix domain socket\n"
+              << "  --socket path     Socket of --server\n"
+              << "  --cache-dir dir   Reuse outputs of earlier compilations of the same input from dir\n"
+              << "  --cache-size mb   Size limit of the cache directory in megabytes, defaults to 256\n"
+              << "  --cache-stats     Print cache statistics, works without an input file\n"
+              << "  --incremental     Only recompile functions that changed since they were cached,\n"
+              << "                    outputs an archive with an object per function. Needs --cache-dir\n"
+              << "  --time-report     Print the time spent in every phase and LLVM pass\n"
+              << "  --trace=file      Write the phases and LLVM passes as a Chrome trace, see chrome://tracing\n"
+              << "  --memory-report=file  Write allocations and peak RSS of every phase as json\n"
+              << "  --stats[=file]    Print or write tokens, AST nodes, IR instructions and code size per function\n"
+              << std::endl;
+}
+
+inline bool parseUnsigned(const std::string &str, unsigned &result)
+{
+    if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    result = static_cast<unsigned>(std::stoul(str));
+    return true;
+}
+
+inline bool parseArgumentList(const std::string &str, std::vector<std::string> &result)
+{
+    std::stringstream stream(str);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (item.empty()) {
+            return false;
+        }
+        result.push_back(item);
+    }
+    return true;
+}
+
+// Matches both "--name value" and "--name=value"
+inline bool parseOptionValue(int argc, char **argv, int &i, const std::string &name, std::string &value)
+{
+    std::string arg = argv[i];
+    if (arg == name && i + 1 < argc) {
+        value = argv[++i];
+        return true;
+    }
+    if (arg.compare(0, name.size() + 1, name + "=") == 0) {
+        value = arg.substr(name.size() + 1);
+        return true;
+    }
+    return false;
+}
+
+inline bool parseOptions(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string value;
+
+        if (parseOptionValue(argc, argv, i, "-mcpu", value)) {
+            options.cpu = value;
+        } else if (parseOptionValue(argc, argv, i, "-mattr", value)) {
+            options.features = value;
+        } else if (arg == "-ffast-math") {
+            options.fastMath = true;
+        } else if (parseOptionValue(argc, argv, i, "-ffp-contract", value)) {
+            if (value == "off") {
+                options.fpContract = FpContract::off;
+            } else if (value == "on") {
+                options.fpContract = FpContract::on;
+            } else if (value == "fast") {
+                options.fpContract = FpContract::fast;
+            } else {
+                errs() << "ERROR: Invalid -ffp-contract value " << value << ", expected off, on or fast" << std::endl;
+                return false;
+            }
+        } else if (parseOptionValue(argc, argv, i, "--output-dir", value)) {
+            options.outputDir = value;
+        } else if (arg == "--batch") {
+            options.batch = true;
+        } else if (parseOptionValue(argc, argv, i, "--multiversion", value)) {
+            if (!parseIsaLevels(value, options.multiversion)) {
+                errs() << "ERROR: Invalid --multiversion list " << value << ", the levels are sse4.2, avx2 and avx512"
+                       << std::endl;
+                return false;
+            }
+        } else if (arg == "--server") {
+            options.server = true;
+        } else if (parseOptionValue(argc, argv, i, "--socket", value)) {
+            options.socketPath = value;
+        } else if (parseOptionValue(argc, argv, i, "--cache-dir", value)) {
+            options.cacheDir = value;
+        } else if (parseOptionValue(argc, argv, i, "--cache-size", value)) {
+            unsigned megabytes = 0;
+            if (!parseUnsigned(value, megabytes)) {
+                errs() << "ERROR: Invalid cache size " << value << std::endl;
+                return false;
+            }
+            options.cacheMaxSize = uint64_t(megabytes) * 1024 * 1024;
+        } else if (arg == "--cache-stats") {
+            options.cacheStats = true;
+        } else if (arg == "--incremental") {
+            options.incremental = true;
+        } else if (arg == "--time-report") {
+            options.timeReport = true;
+        } else if (parseOptionValue(argc, argv, i, "--trace", value)) {
+            options.traceFile = value;
+        } else if (parseOptionValue(argc, argv, i, "--memory-report", value)) {
+            options.memoryReportFile = value;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg.compare(0, 8, "--stats=") == 0) {
+            options.stats = true;
+            options.statsFile = arg.substr(8);
+        } else if (arg == "--repl") {
+            options.repl = true;
+        } else if (arg == "--run") {
+            options.runInJit = true;
+        } else if (parseOptionValue(argc, argv, i, "--entry", value)) {
+            options.entry = value;
+        } else if (parseOptionValue(argc, argv, i, "--args", value)) {
+            if (!parseArgumentList(value, options.entryArgs)) {
+                errs() << "ERROR: Invalid argument list " << value << std::endl;
+                return false;
+            }
+        } else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0) {
+            if (!parseUnsigned(arg.substr(2), options.optLevel) || options.optLevel > 3) {
+                errs() << "ERROR: Invalid optimization level " << arg << std::endl;
+                return false;
+            }
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            // Only -jN and -j=N carry a count, so that the file of "-j 2024" stays the input file
+            std::string count = arg.substr(arg.compare(0, 3, "-j=") == 0 ? 3 : 2);
+            if (arg == "-j") {
+                options.jobs = std::max(1u, std::thread::hardware_concurrency());
+            } else if (!parseUnsigned(count, options.jobs)) {
+                errs() << "ERROR: Invalid job count " << arg << std::endl;
+                return false;
+            }
+            if (options.jobs == 0) {
+                errs() << "ERROR: Job count must be at least 1" << std::endl;
+                return false;
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            errs() << "ERROR: Unknown option " << arg << std::endl;
+            return false;
+        } else if (options.inputFile.empty()) {
+            options.inputFile = arg;
+        } else {
+            errs() << "ERROR: Only one input file is supported" << std::endl;
+            return false;
+        }
+    }
+
+    if ((options.cacheStats || options.incremental) && options.cacheDir.empty()) {
+        errs() << "ERROR: --cache-stats and --incremental need a --cache-dir" << std::endl;
+        return false;
+    }
+
+    if (options.inputFile.empty() && !options.repl && !options.cacheStats && !options.server) {
+        errs() << "ERROR: No input file given" << std::endl;
+        return false;
+    }
+
+    if (!options.multiversion.empty() && (options.runInJit || options.repl)) {
+        errs() << "ERROR: --multiversion only applies to object output, the jit already compiles for this cpu"
+               << std::endl;
+        return false;
+    }
+
+    if (options.runInJit && options.entry.empty()) {
+        errs() << "ERROR: --run needs an --entry function" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace cju
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+
+namespace cju
+{
+
+// Where the compiler prints its output and errors. The streams are per thread, so that
+// concurrent compilations, e.g. on the server or through libcju, capture their own output.
+static thread_local std::ostream *outputStream = &std::cout;
+static thread_local std::ostream *errorStream = &std::cerr;
+
+inline std::ostream &outs()
+{
+    return *outputStream;
+}
+
+inline std::ostream &errs()
+{
+    return *errorStream;
+}
+
+// Sends outs() and errs() of the calling thread to other streams until it goes out of scope
+struct OutputRedirect {
+    OutputRedirect(std::ostream &output, std::ostream &errors)
+        : oldOutput(outputStream)
+        , oldErrors(errorStream)
+    {
+        outputStream = &output;
+        errorStream = &errors;
+    }
+
+    ~OutputRedirect()
+    {
+        outputStream = oldOutput;
+        errorStream = oldErrors;
+    }
+
+    OutputRedirect(const OutputRedirect &) = delete;
+    OutputRedirect &operator=(const OutputRedirect &) = delete;
+
+    std::ostream *oldOutput;
+    std::ostream *oldErrors;
+};
+
+} // namespace cju
@@ -0,0 +1,128 @@
+#pragma once
+
+// Wire format between cju --server and cju-client. Kept free of LLVM, so that the client stays thin.
+// A message is a count followed by that many length prefixed strings, in native byte order since
+// both ends always run on the same machine.
+//   request:  working directory, stdin contents, arguments...
+//   response: exit code, stdout, stderr
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cju
+{
+
+static constexpr uint64_t maxMessageStrings = 1 << 16;
+static constexpr uint64_t maxMessageStringSize = uint64_t(1) << 32;
+
+inline std::string defaultSocketPath()
+{
+    const char *runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir && *runtimeDir) {
+        return std::string(runtimeDir) + "/cju.sock";
+    }
+    return "/tmp/cju-" + std::to_string(getuid()) + ".sock";
+}
+
+inline bool fillSocketAddress(const std::string &path, sockaddr_un &address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Returns the connected socket, or -1 if no server is listening on the path
+inline int connectToServer(const std::string &path)
+{
+    sockaddr_un address;
+    if (!fillSocketAddress(path, address)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool writeAll(int fd, const void *data, size_t size)
+{
+    auto *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+inline bool readAll(int fd, void *data, size_t size)
+{
+    auto *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t count = read(fd, bytes, size);
+        if (count <= 0) {
+            return false;
+        }
+        bytes += count;
+        size -= static_cast<size_t>(count);
+    }
+    return true;
+}
+
+inline bool writeMessage(int fd, const std::vector<std::string> &strings)
+{
+    uint64_t count = strings.size();
+    if (!writeAll(fd, &count, sizeof(count))) {
+        return false;
+    }
+    for (auto &string : strings) {
+        uint64_t size = string.size();
+        if (!writeAll(fd, &size, sizeof(size)) || !writeAll(fd, string.data(), string.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool readMessage(int fd, std::vector<std::string> &strings)
+{
+    uint64_t count = 0;
+    if (!readAll(fd, &count, sizeof(count)) || count > maxMessageStrings) {
+        return false;
+    }
+
+    strings.resize(count);
+    for (auto &string : strings) {
+        uint64_t size = 0;
+        if (!readAll(fd, &size, sizeof(size)) || size > maxMessageStringSize) {
+            return false;
+        }
+        string.resize(size);
+        if (size > 0 && !readAll(fd, &string[0], size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace cju
@@ -0,0 +1,210 @@
+// Thread pool behind parallel for. Every loop is split evenly between the threads of the pool, each
+// of which works through its range in chunks. A thread that runs out steals the back half of the
+// range of another one, so that uneven iterations still keep every core busy.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "runtime.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Chunks per thread of an evenly split loop. More of them balance better, fewer cost less locking.
+#define CHUNKS_PER_THREAD 8
+
+// Iterations [next, end) a thread has left. The owner takes chunks from the front, thieves split
+// off the back. Padded to a cache line so that the threads don't contend on each other's ranges.
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    int64_t next;
+    int64_t end;
+} cju_worker;
+
+static struct {
+    pthread_mutex_t lock; // Guards everything below but the worker ranges
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_mutex_t busy; // Held by the thread whose loop the pool runs
+    int threadCount; // Including the thread that starts a loop
+    cju_worker *workers;
+    uint64_t generation; // Counts the loops, the helpers wait for it to change
+    int running; // Helpers that haven't finished the current loop
+    cju_loop_body body;
+    void *context;
+    uint64_t chunk;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_once_t poolStarted = PTHREAD_ONCE_INIT;
+
+// Set on the threads that run a loop body, where nested loops run serially
+static _Thread_local int insideLoop;
+
+static int takeChunk(cju_worker *worker, int64_t *begin, int64_t *end)
+{
+    int found = 0;
+    pthread_mutex_lock(&worker->lock);
+    uint64_t remaining = (uint64_t)worker->end - (uint64_t)worker->next;
+    if (worker->next < worker->end) {
+        *begin = worker->next;
+        *end = remaining > pool.chunk ? (int64_t)((uint64_t)*begin + pool.chunk) : worker->end;
+        worker->next = *end;
+        found = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return found;
+}
+
+// Moves the back half of the first range with more than a chunk left to the thief and takes a
+// chunk of it. Ranges of a chunk or less are left to their owner, who is about to run them anyway.
+static int stealChunk(int thief, int64_t *begin, int64_t *end)
+{
+    for (int i = 1; i < pool.threadCount; ++i) {
+        cju_worker *victim = &pool.workers[(thief + i) % pool.threadCount];
+        int64_t stolenBegin = 0;
+        int64_t stolenEnd = 0;
+        pthread_mutex_lock(&victim->lock);
+        uint64_t remaining = (uint64_t)victim->end - (uint64_t)victim->next;
+        if (victim->next < victim->end && remaining > pool.chunk) {
+            stolenBegin = (int64_t)((uint64_t)victim->next + remaining / 2);
+            stolenEnd = victim->end;
+            victim->end = stolenBegin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (stolenBegin < stolenEnd) {
+            cju_worker *worker = &pool.workers[thief];
+            pthread_mutex_lock(&worker->lock);
+            worker->next = stolenBegin;
+            worker->end = stolenEnd;
+            pthread_mutex_unlock(&worker->lock);
+            return takeChunk(worker, begin, end);
+        }
+    }
+    return 0;
+}
+
+// A thread only stops once its own range is empty and no other one has more than a chunk left,
+// so every iteration has run by the time all of them stopped
+static void runWorker(int self)
+{
+    int64_t begin;
+    int64_t end;
+    while (takeChunk(&pool.workers[self], &begin, &end) || stealChunk(self, &begin, &end)) {
+        pool.body(begin, end, pool.context);
+    }
+}
+
+static void *helperMain(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    insideLoop = 1;
+
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        runWorker(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+// The helpers start with the first loop and stay for the lifetime of the process
+static void startPool(void)
+{
+    long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *requested = getenv("CJU_NUM_THREADS");
+    if (requested && atol(requested) > 0) {
+        threadCount = atol(requested);
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    pool.workers = aligned_alloc(_Alignof(cju_worker), sizeof(cju_worker) * (size_t)threadCount);
+    if (!pool.workers) {
+        pool.threadCount = 1;
+        return;
+    }
+    for (long i = 0; i < threadCount; ++i) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+    }
+
+    pool.threadCount = 1;
+    for (long i = 1; i < threadCount; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, helperMain, (void *)(intptr_t)i) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        ++pool.threadCount;
+    }
+}
+
+void cju_parallel_for(int64_t begin, int64_t end, cju_loop_body body, void *context)
+{
+    if (begin >= end) {
+        return;
+    }
+    uint64_t count = (uint64_t)end - (uint64_t)begin;
+
+    pthread_once(&poolStarted, startPool);
+    // Loops of other threads already keep the pool busy, this one runs on its own thread then
+    if (insideLoop || count < 2 || pool.threadCount == 1 || pthread_mutex_trylock(&pool.busy) != 0) {
+        body(begin, end, context);
+        return;
+    }
+    insideLoop = 1;
+
+    uint64_t threadCount = (uint64_t)pool.threadCount;
+    uint64_t share = count / threadCount;
+    uint64_t extra = count % threadCount;
+    uint64_t next = (uint64_t)begin;
+    for (uint64_t i = 0; i < threadCount; ++i) {
+        cju_worker *worker = &pool.workers[i];
+        uint64_t size = share + (i < extra ? 1 : 0);
+        pthread_mutex_lock(&worker->lock);
+        worker->next = (int64_t)next;
+        worker->end = (int64_t)(next + size);
+        pthread_mutex_unlock(&worker->lock);
+        next += size;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.body = body;
+    pool.context = context;
+    pool.chunk = count / (threadCount * CHUNKS_PER_THREAD);
+    if (pool.chunk == 0) {
+        pool.chunk = 1;
+    }
+    pool.running = pool.threadCount - 1;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    runWorker(0);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    insideLoop = 0;
+    pthread_mutex_unlock(&pool.busy);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// Runtime library of compiled cju code, see build.sh for libcjurt.a. Objects that use parallel for
+// link it together with pthreads, e.g. gcc output.o libcjurt.a -lpthread.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Outlined body of a parallel for, runs the iterations [begin, end) with the captured locals in context
+typedef void (*cju_loop_body)(int64_t begin, int64_t end, void *context);
+
+// Runs body over [begin, end) on the thread pool and returns once every iteration is done. The
+// calling thread works on the loop too. Loops started from inside a loop body run on the calling
+// thread alone. CJU_NUM_THREADS sets the size of the pool, the default is one thread per core.
+void cju_parallel_for(int64_t begin, int64_t end, cju_loop_body body, void *context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,345 @@
+#pragma once
+
+#include "common.h"
+#include "backend.hpp"
+#include "cache.hpp"
+#include "options.hpp"
+#include "output.hpp"
+#include "protocol.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <sys/stat.h>
+
+namespace cju
+{
+
+using CompileFunc = int (*)(const Options &options, std::istream &input);
+
+// Printed output and output files of a successful compilation, replayed for the same request
+struct ServerCacheEntry {
+    std::string out;
+    std::string err;
+    std::vector<std::string> outputs; // Contents of output<extension> for every compileOutputExtensions
+    uint64_t size = 0;
+};
+
+// Entries are evicted in insertion order once the cache grows past maxSize
+struct ServerCache {
+    uint64_t maxSize = 0;
+    uint64_t size = 0;
+    std::unordered_map<std::string, ServerCacheEntry> entries;
+    std::deque<std::string> insertionOrder;
+};
+
+struct Server {
+    CompileFunc compile = nullptr;
+    std::string socketPath;
+    std::atomic<bool> stopping { false };
+
+    std::mutex connectionsMutex;
+    std::condition_variable connectionsChanged;
+    std::deque<int> connections;
+
+    // Compilations run concurrently on the thread pool, the compiler state is per thread. Only
+    // requests for reports take the lock exclusively, the timers and counters are process wide.
+    std::shared_timed_mutex compileMutex;
+    std::mutex cacheMutex;
+    ServerCache cache;
+};
+
+// Redirects outs() and errs() of the handling thread into strings while a request is handled
+struct StreamCapture {
+    StreamCapture()
+        : redirect(out, err)
+    {
+    }
+
+    std::vector<std::string> response(int exitCode)
+    {
+        return { std::to_string(exitCode), out.str(), err.str() };
+    }
+
+    std::ostringstream out;
+    std::ostringstream err;
+    OutputRedirect redirect;
+};
+
+// Paths in a request are relative to the working directory of the client
+inline void resolveClientPath(const std::string &cwd, std::string &path)
+{
+    if (path.empty() || path == "-" || llvm::sys::path::is_absolute(path)) {
+        return;
+    }
+    path = joinPath(cwd, path);
+}
+
+inline void resolveClientPaths(const std::string &cwd, Options &options)
+{
+    if (options.outputDir.empty()) {
+        options.outputDir = cwd;
+    }
+    resolveClientPath(cwd, options.inputFile);
+    resolveClientPath(cwd, options.outputDir);
+    resolveClientPath(cwd, options.cacheDir);
+    resolveClientPath(cwd, options.traceFile);
+    resolveClientPath(cwd, options.memoryReportFile);
+    resolveClientPath(cwd, options.statsFile);
+}
+
+inline bool needsExclusiveCompile(const Options &options)
+{
+    return options.timeReport || !options.traceFile.empty() || !options.memoryReportFile.empty() || options.stats;
+}
+
+// Only plain compilations are cached, reports and the disk cache have side effects of their own
+inline bool isServerCacheable(const Options &options)
+{
+    return !options.inputFile.empty() && options.cacheDir.empty() && !needsExclusiveCompile(options);
+}
+
+inline const ServerCacheEntry *serverCacheLookup(ServerCache &cache, const std::string &key)
+{
+    auto it = cache.entries.find(key);
+    return it != cache.entries.end() ? &it->second : nullptr;
+}
+
+inline void serverCacheStore(ServerCache &cache, const std::string &key, ServerCacheEntry entry)
+{
+    entry.size = entry.out.size() + entry.err.size();
+    for (auto &output : entry.outputs) {
+        entry.size += output.size();
+    }
+
+    // Identical requests that compiled at the same time store the same key, the last one replaces
+    // the entry but keeps its place in the insertion order
+    auto existing = cache.entries.find(key);
+    if (existing != cache.entries.end()) {
+        cache.size -= existing->second.size;
+    } else {
+        cache.insertionOrder.push_back(key);
+    }
+    cache.size += entry.size;
+    cache.entries[key] = std::move(entry);
+
+    while (cache.size > cache.maxSize && !cache.insertionOrder.empty()) {
+        auto it = cache.entries.find(cache.insertionOrder.front());
+        cache.insertionOrder.pop_front();
+        if (it == cache.entries.end()) {
+            continue;
+        }
+        cache.size -= it->second.size;
+        cache.entries.erase(it);
+    }
+}
+
+inline void stopServer(Server &server)
+{
+    server.stopping = true;
+
+    // Wakes up the accepting thread, which sees stopping and leaves
+    int fd = connectToServer(server.socketPath);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Handles {working directory, stdin, arguments...} and returns {exit code, stdout, stderr}
+inline std::vector<std::string> handleServerRequest(Server &server, const std::vector<std::string> &request)
+{
+    const std::string &cwd = request[0];
+    const std::string &input = request[1];
+    std::vector<std::string> args(request.begin() + 2, request.end());
+
+    if (args.size() == 1 && args[0] == "--stop-server") {
+        stopServer(server);
+        return { std::to_string(EXIT_SUCCESS), "cju server stopped\n", "" };
+    }
+
+    StreamCapture capture;
+
+    std::vector<char *> argv { const_cast<char *>("cju") };
+    for (auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    Options options;
+    if (!parseOptions(static_cast<int>(args.size() + 1), argv.data(), options)) {
+        printUsage("cju-client");
+        return capture.response(EXIT_FAILURE);
+    }
+    if (options.server || options.repl || options.runInJit) {
+        errs() << "ERROR: --server, --repl and --run are not available through cju-client" << std::endl;
+        return capture.response(EXIT_FAILURE);
+    }
+    resolveClientPaths(cwd, options);
+
+    std::shared_lock<std::shared_timed_mutex> sharedLock(server.compileMutex, std::defer_lock);
+    std::unique_lock<std::shared_timed_mutex> exclusiveLock(server.compileMutex, std::defer_lock);
+    if (needsExclusiveCompile(options)) {
+        exclusiveLock.lock();
+    } else {
+        sharedLock.lock();
+    }
+
+    std::vector<std::string> extensions = compileOutputExtensions(options);
+    std::string key;
+    std::string source = input;
+    if (isServerCacheable(options) && (options.inputFile == "-" || readWholeFile(options.inputFile, source))) {
+        key = hashCacheKey(options, { "server", outputKind(options), options.inputFile, options.outputDir, source });
+
+        std::lock_guard<std::mutex> cacheLock(server.cacheMutex);
+        if (const ServerCacheEntry *entry = serverCacheLookup(server.cache, key)) {
+            if (!options.outputDir.empty()) {
+                if (std::error_code ec = llvm::sys::fs::create_directories(options.outputDir)) {
+                    errs() << "Could not create output directory " << options.outputDir << ": " << ec.message()
+                           << std::endl;
+                    return capture.response(EXIT_FAILURE);
+                }
+            }
+            for (size_t i = 0; i < extensions.size(); ++i) {
+                std::string path = joinPath(options.outputDir, "output" + extensions[i]);
+                std::ofstream file(path, std::ios::binary);
+                file << entry->outputs[i];
+                file.close();
+                if (!file) {
+                    errs() << "Could not write " << path << " from the server cache" << std::endl;
+                    return capture.response(EXIT_FAILURE);
+                }
+            }
+            return { std::to_string(EXIT_SUCCESS), entry->out, entry->err };
+        }
+    }
+
+    std::istringstream inputStream(input);
+    int exitCode = server.compile(options, inputStream);
+
+    if (!key.empty() && exitCode == EXIT_SUCCESS) {
+        ServerCacheEntry entry;
+        entry.out = capture.out.str();
+        entry.err = capture.err.str();
+        entry.outputs.resize(extensions.size());
+        bool complete = true;
+        for (size_t i = 0; i < extensions.size(); ++i) {
+            complete &= readWholeFile(joinPath(options.outputDir, "output" + extensions[i]), entry.outputs[i]);
+        }
+        if (complete) {
+            std::lock_guard<std::mutex> cacheLock(server.cacheMutex);
+            serverCacheStore(server.cache, key, std::move(entry));
+        }
+    }
+
+    return capture.response(exitCode);
+}
+
+inline void serveConnections(Server &server)
+{
+    for (;;) {
+        int fd = -1;
+        {
+            std::unique_lock<std::mutex> lock(server.connectionsMutex);
+            server.connectionsChanged.wait(lock, [&]() { return !server.connections.empty() || server.stopping; });
+            if (server.connections.empty()) {
+                return;
+            }
+            fd = server.connections.front();
+            server.connections.pop_front();
+        }
+
+        std::vector<std::string> request;
+        if (readMessage(fd, request) && request.size() >= 2) {
+            writeMessage(fd, handleServerRequest(server, request));
+        }
+        close(fd);
+    }
+}
+
+// Listens on the socket until a client sends --stop-server. Targets are registered once up front,
+// and successful compilations are kept in memory, so repeated requests skip the compiler entirely.
+inline int runServer(const Options &options, CompileFunc compile)
+{
+    Server server;
+    server.compile = compile;
+    server.socketPath = options.socketPath.empty() ? defaultSocketPath() : options.socketPath;
+    server.cache.maxSize = options.cacheMaxSize;
+
+    int runningFd = connectToServer(server.socketPath);
+    if (runningFd >= 0) {
+        close(runningFd);
+        errs() << "A cju server is already listening on " << server.socketPath << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_un address;
+    if (!fillSocketAddress(server.socketPath, address)) {
+        errs() << "Socket path " << server.socketPath << " is too long" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Nothing answered, so a socket file left there is from a server that didn't shut down cleanly
+    unlink(server.socketPath.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        errs() << "Could not create socket: " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Only the user running the server may connect to it
+    mode_t oldMask = umask(0077);
+    int bound = bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    umask(oldMask);
+    if (bound != 0 || listen(listenFd, SOMAXCONN) != 0) {
+        errs() << "Could not listen on " << server.socketPath << ": " << std::strerror(errno) << std::endl;
+        close(listenFd);
+        return EXIT_FAILURE;
+    }
+
+    // A client that goes away early must not kill the server while its response is written
+    std::signal(SIGPIPE, SIG_IGN);
+
+    initializeTargets();
+
+    std::vector<std::thread> threads;
+    unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threadCount; ++i) {
+        threads.emplace_back(serveConnections, std::ref(server));
+    }
+
+    outs() << "cju server listening on " << server.socketPath << std::endl;
+
+    while (!server.stopping) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errs() << "Could not accept connection: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (server.stopping) {
+            close(fd);
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(server.connectionsMutex);
+        server.connections.push_back(fd);
+        server.connectionsChanged.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(server.connectionsMutex);
+        server.stopping = true;
+        server.connectionsChanged.notify_all();
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    close(listenFd);
+    unlink(server.socketPath.c_str());
+    return EXIT_SUCCESS;
+}
+
+} // namespace cju
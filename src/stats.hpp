@@ -0,0 +1,204 @@
+#pragma once
+
+#include "common.h"
+#include "ast.hpp"
+#include "output.hpp"
+
+namespace cju
+{
+
+struct FunctionStats {
+    uint64_t tokens = 0;
+    std::map<std::string, uint64_t> astNodes;
+    uint64_t irInstructions = 0;
+    uint64_t basicBlocks = 0;
+    uint64_t optimizedIrInstructions = 0;
+    uint64_t optimizedBasicBlocks = 0;
+    uint64_t machineCodeBytes = 0;
+};
+
+// Counters of the input and of every stage it went through, filled in by run() when --stats is given
+struct CompileStats {
+    bool enabled = false;
+    std::string inputFile;
+    uint64_t tokens = 0;
+    std::map<std::string, uint64_t> astNodes;
+    std::map<std::string, FunctionStats> functions;
+};
+
+static CompileStats compileStats;
+
+inline void enableCompileStats(const std::string &inputFile)
+{
+    compileStats.enabled = true;
+    compileStats.inputFile = inputFile;
+
+    // Only has an effect if LLVM was built with assertions or LLVM_FORCE_ENABLE_STATS
+    llvm::EnableStatistics(false);
+}
+
+inline void resetCompileStats()
+{
+    compileStats = CompileStats();
+    llvm::ResetStatistics();
+}
+
+inline void countAstNodesByKind(ExprAST *node, std::map<std::string, uint64_t> &counts)
+{
+    counts[node->kindName()]++;
+    node->visitChildren([&](ExprAST *child) { countAstNodesByKind(child, counts); });
+}
+
+inline void recordAstStats(ExprAST *ast, size_t tokenCount)
+{
+    compileStats.tokens = tokenCount;
+    countAstNodesByKind(ast, compileStats.astNodes);
+
+    if (auto *unit = dynamic_cast<TranslationUnitAST *>(ast)) {
+        for (auto *decl : unit->decls) {
+            if (auto *function = dynamic_cast<FunctionAST *>(decl)) {
+                auto &stats = compileStats.functions[function->proto->name];
+                stats.tokens = function->tokenCount;
+                countAstNodesByKind(function, stats.astNodes);
+            }
+        }
+    }
+}
+
+// Functions that were inlined into others and removed by the optimizer keep zero optimized counts
+inline void recordIrStats(const llvm::Module &module, bool optimized)
+{
+    for (auto &function : module) {
+        if (function.isDeclaration()) {
+            continue;
+        }
+        auto &stats = compileStats.functions[function.getName().str()];
+        (optimized ? stats.optimizedIrInstructions : stats.irInstructions) = function.getInstructionCount();
+        (optimized ? stats.optimizedBasicBlocks : stats.basicBlocks) = function.size();
+    }
+}
+
+inline void recordObjectMachineCodeStats(const llvm::object::ObjectFile &object)
+{
+    for (auto &symbolSize : llvm::object::computeSymbolSizes(object)) {
+        auto type = symbolSize.first.getType();
+        auto name = symbolSize.first.getName();
+        if (!type || *type != llvm::object::SymbolRef::ST_Function || !name) {
+            llvm::consumeError(type.takeError());
+            llvm::consumeError(name.takeError());
+            continue;
+        }
+
+        std::string functionName = name->str();
+        // Mach-O prefixes every symbol with an underscore
+        if (!compileStats.functions.count(functionName) && !functionName.empty() && functionName[0] == '_') {
+            functionName = functionName.substr(1);
+        }
+        compileStats.functions[functionName].machineCodeBytes += symbolSize.second;
+    }
+}
+
+// Reads the sizes of the function symbols back from the emitted object or archive
+inline bool recordMachineCodeStats(const std::string &filename)
+{
+    auto binary = llvm::object::createBinary(filename);
+    if (!binary) {
+        errs() << "Could not read " << filename << " for statistics: " << llvm::toString(binary.takeError())
+                  << std::endl;
+        return false;
+    }
+
+    if (auto *object = llvm::dyn_cast<llvm::object::ObjectFile>(binary->getBinary())) {
+        recordObjectMachineCodeStats(*object);
+        return true;
+    }
+
+    if (auto *archive = llvm::dyn_cast<llvm::object::Archive>(binary->getBinary())) {
+        llvm::Error error = llvm::Error::success();
+        for (auto &child : archive->children(error)) {
+            auto member = child.getAsBinary();
+            if (!member) {
+                llvm::consumeError(member.takeError());
+                continue;
+            }
+            if (auto *object = llvm::dyn_cast<llvm::object::ObjectFile>(member->get())) {
+                recordObjectMachineCodeStats(*object);
+            }
+        }
+        if (error) {
+            errs() << "Could not read " << filename << " for statistics: " << llvm::toString(std::move(error))
+                      << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+inline nlohmann::json compileStatsToJson()
+{
+    nlohmann::json json;
+    json["file"] = compileStats.inputFile;
+    json["tokens"] = compileStats.tokens;
+    json["astNodes"] = compileStats.astNodes;
+
+    uint64_t irInstructions = 0;
+    uint64_t optimizedIrInstructions = 0;
+    uint64_t basicBlocks = 0;
+    uint64_t optimizedBasicBlocks = 0;
+    uint64_t machineCodeBytes = 0;
+
+    auto &functions = json["functions"];
+    functions = nlohmann::json::object();
+    for (auto &entry : compileStats.functions) {
+        const FunctionStats &stats = entry.second;
+        auto &function = functions[entry.first];
+        function["tokens"] = stats.tokens;
+        function["astNodes"] = stats.astNodes;
+        function["irInstructions"] = stats.irInstructions;
+        function["optimizedIrInstructions"] = stats.optimizedIrInstructions;
+        function["basicBlocks"] = stats.basicBlocks;
+        function["optimizedBasicBlocks"] = stats.optimizedBasicBlocks;
+        function["machineCodeBytes"] = stats.machineCodeBytes;
+
+        irInstructions += stats.irInstructions;
+        optimizedIrInstructions += stats.optimizedIrInstructions;
+        basicBlocks += stats.basicBlocks;
+        optimizedBasicBlocks += stats.optimizedBasicBlocks;
+        machineCodeBytes += stats.machineCodeBytes;
+    }
+
+    json["irInstructions"] = irInstructions;
+    json["optimizedIrInstructions"] = optimizedIrInstructions;
+    json["basicBlocks"] = basicBlocks;
+    json["optimizedBasicBlocks"] = optimizedBasicBlocks;
+    json["machineCodeBytes"] = machineCodeBytes;
+
+    auto &llvmStatistics = json["llvmStatistics"];
+    llvmStatistics = nlohmann::json::object();
+    for (auto &statistic : llvm::GetStatistics()) {
+        llvmStatistics[statistic.first.str()] = statistic.second;
+    }
+
+    return json;
+}
+
+// Prints the statistics to stdout when filename is empty
+inline bool writeCompileStats(const std::string &filename)
+{
+    auto json = compileStatsToJson();
+    if (filename.empty()) {
+        outs() << "\nStatistics:\n" << json.dump(4) << std::endl;
+        return true;
+    }
+
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        errs() << "Could not open statistics file " << filename << std::endl;
+        return false;
+    }
+    file << json.dump(4) << std::endl;
+    return true;
+}
+
+} // namespace cju
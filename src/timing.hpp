@@ -0,0 +1,297 @@
+#pragma once
+
+#include "common.h"
+#include "memory.hpp"
+#include "options.hpp"
+#include "output.hpp"
+
+namespace cju
+{
+
+struct PhaseTiming {
+    std::string name;
+    std::string detail;
+    uint64_t threadId;
+    double startUs;
+    double wallUs;
+    double cpuUs;
+    AllocationCounters allocations;
+    uint64_t peakRssBeforeBytes;
+    uint64_t peakRssAfterBytes;
+};
+
+// Phases are only recorded after enablePhaseTimings, so timers cost next to nothing otherwise
+static bool phaseTimingsEnabled = false;
+static std::chrono::steady_clock::time_point phaseTimingsStart;
+static std::vector<PhaseTiming> phaseTimings;
+static std::mutex phaseTimingsMutex;
+
+inline void enablePhaseTimings(bool llvmTimeTrace)
+{
+    phaseTimingsEnabled = true;
+    phaseTimingsStart = std::chrono::steady_clock::now();
+
+    // LLVM's passes record their own spans into the time trace profiler, they are merged
+    // with our phases when the trace is written
+    if (llvmTimeTrace) {
+        llvm::timeTraceProfilerInitialize(0, "cju");
+    }
+}
+
+// LLVM's time trace profiler records per thread since LLVM 11. A thread started for the compilation
+// records into a profiler of its own while this lives, which the trace of the main thread takes
+// over when it ends. traced is whether the thread that started it has a profiler.
+struct ThreadTimeTrace {
+    ThreadTimeTrace(bool traced)
+        : traced(traced)
+    {
+#if LLVM_VERSION_MAJOR >= 11
+        if (traced) {
+            llvm::timeTraceProfilerInitialize(0, "cju");
+        }
+#endif
+    }
+
+    ~ThreadTimeTrace()
+    {
+#if LLVM_VERSION_MAJOR >= 11
+        if (traced) {
+            llvm::timeTraceProfilerFinishThread();
+        }
+#endif
+    }
+
+    ThreadTimeTrace(const ThreadTimeTrace &) = delete;
+    ThreadTimeTrace &operator=(const ThreadTimeTrace &) = delete;
+
+    bool traced;
+};
+
+inline double processCpuTimeUs()
+{
+    llvm::sys::TimePoint<> elapsed;
+    std::chrono::nanoseconds userTime;
+    std::chrono::nanoseconds systemTime;
+    llvm::sys::Process::GetTimeUsage(elapsed, userTime, systemTime);
+    return std::chrono::duration<double, std::micro>(userTime + systemTime).count();
+}
+
+// Records the wall and cpu time, allocations and peak RSS from construction to destruction as one phase.
+// The cpu time and allocations are for the whole process, so they include other threads running at the same time.
+struct PhaseTimer {
+    PhaseTimer(const std::string &name, const std::string &detail = "")
+    {
+        if (phaseTimingsEnabled) {
+            timing.name = name;
+            timing.detail = detail;
+            timing.threadId = llvm::get_threadid();
+            timing.peakRssBeforeBytes = peakRssBytes();
+            startAllocations = readAllocationCounters();
+            startTime = std::chrono::steady_clock::now();
+            startCpuUs = processCpuTimeUs();
+        }
+    }
+
+    ~PhaseTimer()
+    {
+        if (phaseTimingsEnabled) {
+            auto endTime = std::chrono::steady_clock::now();
+            timing.startUs = std::chrono::duration<double, std::micro>(startTime - phaseTimingsStart).count();
+            timing.wallUs = std::chrono::duration<double, std::micro>(endTime - startTime).count();
+            timing.cpuUs = processCpuTimeUs() - startCpuUs;
+
+            AllocationCounters endAllocations = readAllocationCounters();
+            timing.allocations.count = endAllocations.count - startAllocations.count;
+            timing.allocations.bytes = endAllocations.bytes - startAllocations.bytes;
+            timing.peakRssAfterBytes = peakRssBytes();
+
+            std::lock_guard<std::mutex> lock(phaseTimingsMutex);
+            phaseTimings.push_back(timing);
+        }
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+    PhaseTiming timing;
+    std::chrono::steady_clock::time_point startTime;
+    double startCpuUs = 0;
+    AllocationCounters startAllocations;
+};
+
+inline void printTimeReport(std::ostream &out)
+{
+    std::vector<PhaseTiming> timings = phaseTimings;
+    std::stable_sort(timings.begin(), timings.end(),
+                     [](const PhaseTiming &a, const PhaseTiming &b) { return a.startUs < b.startUs; });
+
+    out << "===-------------------------------------------------------------------------===\n"
+        << "                              cju phase timings\n"
+        << "===-------------------------------------------------------------------------===\n";
+    out << std::fixed << std::setprecision(3);
+    out << std::setw(12) << "Wall (ms)" << std::setw(12) << "CPU (ms)" << "  Phase\n";
+    for (auto &timing : timings) {
+        out << std::setw(12) << timing.wallUs / 1000.0 << std::setw(12) << timing.cpuUs / 1000.0 << "  "
+            << timing.name << (timing.detail.empty() ? "" : " (" + timing.detail + ")") << "\n";
+    }
+    out << std::defaultfloat << std::endl;
+
+    // Timers of the LLVM passes, enabled through TimePassesIsEnabled
+    llvm::raw_os_ostream llvmOut(out);
+    llvm::reportAndResetTimings(&llvmOut);
+}
+
+// Writes our phases and LLVM's time trace together in the Chrome trace event format
+inline bool writeChromeTrace(const std::string &filename)
+{
+    nlohmann::json trace;
+    auto &events = trace["traceEvents"];
+    events = nlohmann::json::array();
+
+    uint64_t pid = 1;
+    if (llvm::timeTraceProfilerEnabled()) {
+        llvm::SmallVector<char, 0> buffer;
+        llvm::raw_svector_ostream stream(buffer);
+        llvm::timeTraceProfilerWrite(stream);
+        llvm::timeTraceProfilerCleanup();
+
+        auto llvmTrace = nlohmann::json::parse(buffer.begin(), buffer.end(), nullptr, false);
+        if (llvmTrace.is_object() && llvmTrace["traceEvents"].is_array()) {
+            for (auto &event : llvmTrace["traceEvents"]) {
+                if (event.contains("pid") && event["pid"].is_number()) {
+                    pid = event["pid"];
+                }
+                events.push_back(event);
+            }
+        }
+    }
+
+    for (auto &timing : phaseTimings) {
+        nlohmann::json event;
+        event["name"] = timing.name;
+        event["cat"] = "cju";
+        event["ph"] = "X";
+        event["pid"] = pid;
+        event["tid"] = timing.threadId;
+        event["ts"] = timing.startUs;
+        event["dur"] = timing.wallUs;
+        event["args"]["cpu_us"] = timing.cpuUs;
+        if (!timing.detail.empty()) {
+            event["args"]["detail"] = timing.detail;
+        }
+        events.push_back(event);
+    }
+
+    std::ofstream file(filename);
+    if (!file.is_open()) {
+        errs() << "Could not open trace file " << filename << std::endl;
+        return false;
+    }
+    file << trace;
+    return true;
+}
+
+inline const PhaseTiming *findPhaseTiming(const std::string &name)
+{
+    for (auto &timing : phaseTimings) {
+        if (timing.name == name) {
+            return &timing;
+        }
+    }
+    return nullptr;
+}
+
+inline double bytesPerItem(const PhaseTiming *timing, uint64_t itemCount)
+{
+    return timing && itemCount ? double(timing->allocations.bytes) / itemCount : 0.0;
+}
+
+// Writes the allocations and peak RSS of every phase and the sizes of the compiled input as json
+inline bool writeMemoryReport()
+{
+    nlohmann::json report;
+    report["file"] = memoryReport.inputFile;
+    report["peakRssBytes"] = peakRssBytes();
+
+    auto &phases = report["phases"];
+    phases = nlohmann::json::array();
+    for (auto &timing : phaseTimings) {
+        nlohmann::json phase;
+        phase["name"] = timing.name;
+        phase["detail"] = timing.detail;
+        phase["allocations"] = timing.allocations.count;
+        phase["allocatedBytes"] = timing.allocations.bytes;
+        phase["peakRssBeforeBytes"] = timing.peakRssBeforeBytes;
+        phase["peakRssAfterBytes"] = timing.peakRssAfterBytes;
+        phases.push_back(phase);
+    }
+
+    report["tokens"] = memoryReport.tokenCount;
+    report["tokenSizeBytes"] = sizeof(lexer_token);
+    report["allocatedBytesPerToken"] = bytesPerItem(findPhaseTiming("tokenizeFile"), memoryReport.tokenCount);
+    report["astNodes"] = memoryReport.astNodeCount;
+    report["allocatedBytesPerAstNode"] = bytesPerItem(findPhaseTiming("buildAST"), memoryReport.astNodeCount);
+
+    auto &module = report["module"];
+    module["instructions"] = memoryReport.moduleInstructionCount;
+    module["bitcodeBytes"] = memoryReport.moduleBitcodeBytes;
+    module["optimizedInstructions"] = memoryReport.optimizedModuleInstructionCount;
+    module["optimizedBitcodeBytes"] = memoryReport.optimizedModuleBitcodeBytes;
+
+    std::ofstream file(memoryReport.filename);
+    if (!file.is_open()) {
+        errs() << "Could not open memory report file " << memoryReport.filename << std::endl;
+        return false;
+    }
+    file << report.dump(4) << std::endl;
+    return true;
+}
+
+// Enables the timings and memory report requested in the options and writes them once the session ends
+struct TimingSession {
+    TimingSession(const Options &options)
+        : options(options)
+    {
+        if (!options.memoryReportFile.empty()) {
+            enableMemoryReport(options.memoryReportFile, options.inputFile);
+        }
+        if (options.timeReport || !options.traceFile.empty() || memoryReportEnabled()) {
+            enabled = true;
+            enablePhaseTimings(!options.traceFile.empty());
+            llvm::TimePassesIsEnabled = options.timeReport;
+        }
+    }
+
+    ~TimingSession()
+    {
+        // Leaves the process wide state alone when nothing was enabled, other threads may be compiling
+        if (!enabled) {
+            return;
+        }
+
+        if (options.timeReport) {
+            printTimeReport(outs());
+        }
+        if (!options.traceFile.empty()) {
+            writeChromeTrace(options.traceFile);
+        }
+        if (memoryReportEnabled()) {
+            writeMemoryReport();
+        }
+
+        // Start over for the next compilation in the same process
+        phaseTimingsEnabled = false;
+        phaseTimings.clear();
+        llvm::TimePassesIsEnabled = false;
+        allocationCountingEnabled = false;
+        memoryReport = MemoryReport();
+    }
+
+    TimingSession(const TimingSession &) = delete;
+    TimingSession &operator=(const TimingSession &) = delete;
+
+    const Options &options;
+    bool enabled = false;
+};
+
+} // namespace cju
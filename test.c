@@ -1,7 +1,107 @@
 // Test file for the compiler
-float add(float a, float b)
+extern float twice(float value);
+
+simd float add(float a, float b)
 {
     float result = a + b;
     return result;
 }
 
+float twice(float a)
+{
+    float result = a + a;
+    return result;
+}
+
+long scale(long value, int factor)
+{
+    long result = value * factor + 1;
+    return result;
+}
+
+double average(double a, double b)
+{
+    double result = (a + b) / 2;
+    return result;
+}
+
+int truncated(float value)
+{
+    int result = (int)value % 10;
+    return result * 2;
+}
+
+long sumOfSquares(int count)
+{
+    long sum = 0;
+    for (int i = 1; i <= count; i++) {
+        if (i % 3 != 0) {
+            sum += square(i);
+        }
+    }
+    return sum;
+}
+
+static long square(int value)
+{
+    return (long)value * value;
+}
+
+void addScaled(float *restrict out, const float values[], float factor, int count)
+{
+    #pragma vectorize(4) interleave(2)
+    for (int i = 0; i < count; i++) {
+        out[i] += values[i] * factor;
+    }
+}
+
+float hypotenuse(float a, float b)
+{
+    return sqrt(fma(a, a, b * b));
+}
+
+double clamped(double value, double low, double high)
+{
+    return min(max(value, low), high);
+}
+
+float4 mulAdd(float4 a, float4 b, float4 c)
+{
+    return a * b + c;
+}
+
+float4 reversed(float4 v)
+{
+    return shuffle(v, 3, 2, 1, 0);
+}
+
+fastmath float fastDot(const float *a, const float *b, int count)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float total(const float *values, int count)
+{
+    return sum(values, count);
+}
+
+double dotProduct(const double *a, const double *b, int count)
+{
+    return dot(a, b, count);
+}
+
+int smallest(const int *values, int count)
+{
+    return min(values, count);
+}
+
+void squareAll(long *out, int count)
+{
+    parallel for (int i = 0; i < count; i++) {
+        out[i] = square(i);
+    }
+}
@@ -5,8 +5,8 @@ echo ./build.sh
 ./build.sh
 echo
 echo ----Running cju:
-echo ./cju test.c
-./cju test.c
+echo ./cju test.c --batch
+./cju test.c --batch
 
 echo
 echo ----test.c
@@ -14,13 +14,38 @@ cat test.c
 echo
 echo ----tester.c
 cat tester.c
+echo
+echo ----output.h
+cat output.h
 
 echo
 echo ----Compiling cju result with tester.c
-echo gcc output.o tester.c -o tester.out
-gcc output.o tester.c -o tester.out
+echo gcc output.o tester.c libcjurt.a -lpthread -lm -o tester.out
+gcc output.o tester.c libcjurt.a -lpthread -lm -o tester.out
 
 echo
 echo ----Running cju test program:
 echo ./tester.out
 ./tester.out
+
+echo
+echo ----Compiling test.c with sse4.2 and avx2 variants picked at load time:
+echo ./cju test.c --batch --multiversion=sse4.2,avx2 --output-dir multiversion
+mkdir -p multiversion
+./cju test.c --batch --multiversion=sse4.2,avx2 --output-dir multiversion
+echo gcc multiversion/output.o tester.c libcjurt.a -lpthread -lm -o tester-multiversion.out
+gcc multiversion/output.o tester.c libcjurt.a -lpthread -lm -o tester-multiversion.out
+echo ./tester-multiversion.out
+./tester-multiversion.out
+
+echo
+echo ----Running test.c in the cju jit:
+echo ./cju --run test.c --entry add --args 3,4
+./cju --run test.c --entry add --args 3,4
+
+echo
+echo ----Running test.c and another source in a jit of the C++ API:
+echo clang++ -std=c++17 jittester.cpp runtime.o '`llvm-config --cxxflags --ldflags --system-libs --libs core bitreader bitwriter object ipo transformutils orcjit native all-targets`' -lpthread -o jittester.out
+clang++ -std=c++17 jittester.cpp runtime.o `llvm-config --cxxflags --ldflags --system-libs --libs core bitreader bitwriter object ipo transformutils orcjit native all-targets` -lpthread -o jittester.out
+echo ./jittester.out
+./jittester.out
@@ -1,9 +1,64 @@
-// Testing file used to test the compiled output.o
+// Testing file used to test the compiled output.o, declared by the output.h cju --batch writes
 #include <stdio.h>
+#include <xmmintrin.h>
 
-extern float add(float a, float b);
+#include "output.h"
+
+// SSE variant of the simd function add, which vectorized C loops call for add declared with
+// #pragma omp declare simd notinbranch
+extern __m128 _ZGVbN4vv_add(__m128 a, __m128 b);
 
 int main() {
     printf("tester.c: result from add(3.0f, 4.0f) = %f\n", add(3.0f, 4.0f));
+    printf("tester.c: result from twice(3.0f) = %f\n", twice(3.0f));
+    printf("tester.c: result from scale(5000000000, 3) = %ld\n", scale(5000000000L, 3));
+    printf("tester.c: result from average(1.0, 2.0) = %f\n", average(1.0, 2.0));
+    printf("tester.c: result from truncated(123.75f) = %d\n", truncated(123.75f));
+    printf("tester.c: result from sumOfSquares(10) = %ld\n", sumOfSquares(10));
+    printf("tester.c: result from hypotenuse(3.0f, 4.0f) = %f\n", hypotenuse(3.0f, 4.0f));
+    printf("tester.c: result from clamped(7.5, 0.0, 5.0) = %f\n", clamped(7.5, 0.0, 5.0));
+
+    float out[3] = { 1.0f, 2.0f, 3.0f };
+    const float values[3] = { 1.0f, 1.0f, 2.0f };
+    addScaled(out, values, 0.5f, 3);
+    printf("tester.c: result from addScaled = { %f, %f, %f }\n", out[0], out[1], out[2]);
+    printf("tester.c: result from fastDot = %f\n", fastDot(out, values, 3));
+
+    // 37 elements fill whole blocks of the reductions and leave a tail of 5, the first 5 are only a tail
+    float numbers[37];
+    double halves[37];
+    double twos[37];
+    int ints[37];
+    for (int i = 0; i < 37; ++i) {
+        numbers[i] = (float)(i + 1);
+        halves[i] = 0.5 * (i + 1);
+        twos[i] = 2.0;
+        ints[i] = 100 - (i * 7) % 41;
+    }
+    printf("tester.c: result from total(5) = %f, total(37) = %f\n", total(numbers, 5), total(numbers, 37));
+    printf("tester.c: result from dotProduct(5) = %f, dotProduct(37) = %f\n", dotProduct(halves, twos, 5),
+           dotProduct(halves, twos, 37));
+    printf("tester.c: result from smallest(5) = %d, smallest(37) = %d\n", smallest(ints, 5), smallest(ints, 37));
+
+    const float left[5] = { 1.0f, 2.0f, 3.0f, 4.0f, 5.0f };
+    const float right[5] = { 0.5f, 0.25f, -3.0f, 10.0f, 0.0f };
+    float sums[5];
+    add_batch(left, right, sums, 5);
+    printf("tester.c: result from add_batch = { %f, %f, %f, %f, %f }\n", sums[0], sums[1], sums[2], sums[3],
+           sums[4]);
+
+    int64_t squares[5];
+    squareAll(squares, 5);
+    printf("tester.c: result from squareAll = { %ld, %ld, %ld, %ld, %ld }\n", squares[0], squares[1], squares[2],
+           squares[3], squares[4]);
+
+    // float4 is passed and returned like __m128
+    float lanes[4];
+    __m128 a = _mm_setr_ps(1.0f, 2.0f, 3.0f, 4.0f);
+    _mm_storeu_ps(lanes, reversed(mulAdd(a, a, _mm_set1_ps(0.5f))));
+    printf("tester.c: result from reversed(mulAdd) = { %f, %f, %f, %f }\n", lanes[0], lanes[1], lanes[2], lanes[3]);
+
+    _mm_storeu_ps(lanes, _ZGVbN4vv_add(a, _mm_set1_ps(10.0f)));
+    printf("tester.c: result from _ZGVbN4vv_add = { %f, %f, %f, %f }\n", lanes[0], lanes[1], lanes[2], lanes[3]);
     return 0;
 }